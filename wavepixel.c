@@ -48,6 +48,10 @@
         Right Arrow: Next track.
         Left Arrow: Previous track.
         Left + Right Arrows (hold 2s): Pause/Resume.
+    Audio Effects:
+        1-7: Toggle echo, reverb, chorus, vibrato, tremolo, stereo, limiter.
+        - / =: Volume down/up.
+        T: Print audio callback timing (also printed at exit).
 
     Features
 
@@ -102,7 +106,7 @@
     Влияние:
         Меньше значение (ближе к 0.0): Цвет ближе к текущему (current_palette). Например, при blend_factor = 0.0 вы видите только текущий цвет, без влияния следующего.
         Больше значение (ближе к 1.0): Цвет приближается к следующему (next_palette). При blend_factor = 1.0 текущий цвет полностью заменяется следующим.
-    Динамика: Значение увеличивается со временем (в цикле main) на величину blend_speed * 0.016f за кадр (при 60 FPS это примерно 1/60 секунды). Когда достигает 1.0, текущий цвет становится следующим, и процесс начинается заново.
+    Динамика: Значение увеличивается со временем (в цикле main) на величину blend_speed * delta_time за кадр (реальная длительность кадра в секундах, при 60 FPS примерно 1/60). Когда достигает 1.0, текущий цвет становится следующим, и процесс начинается заново.
 
     static float blend_speed = 0.5f
 
@@ -167,8 +171,12 @@
 
 #define SDL_MAIN_HANDLED
 #define _POSIX_C_SOURCE 200809L // Для strdup на POSIX
+#define _DEFAULT_SOURCE // Для d_type в readdir
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
+#ifdef WAVEPIXEL_BAKE
+    #include <fluidsynth.h>
+#endif
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
@@ -176,11 +184,24 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
     #include <windows.h>
     #define STRDUP _strdup
 #else
+    #include <strings.h>
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #ifdef __linux__
+        #include <sys/inotify.h>
+    #endif
     #define STRDUP strdup
 #endif
 
@@ -193,6 +214,7 @@
     #define M_PI acos(-1.0)
 #endif
 
+// Задержки заданы в отсчётах при SAMPLE_RATE; при другой частоте масштабируются в effect_chain_create()
 #define SAMPLE_RATE 44100
 #define ECHO_DELAY (SAMPLE_RATE / 4) // 0.25 сек
 #define REVERB_DELAY_1 (SAMPLE_RATE / 20)  // 50 мс
@@ -205,44 +227,161 @@
 #define CHORUS_DELAY_3 (SAMPLE_RATE / 50)   // 20 мс
 #define STEREO_DELAY (SAMPLE_RATE / 200)  // 5 мс
 
-static Sint16 echo_buffer[ECHO_DELAY] = {0};
-static int echo_pos = 0;
-static Sint16 reverb_buffer1[REVERB_DELAY_1] = {0};
-static Sint16 reverb_buffer2[REVERB_DELAY_2] = {0};
-static Sint16 reverb_buffer3[REVERB_DELAY_3] = {0};
-static Sint16 reverb_buffer4[REVERB_DELAY_4] = {0};
-static Sint16 reverb_buffer5[REVERB_DELAY_5] = {0};
-static int reverb_pos1 = 0, reverb_pos2 = 0, reverb_pos3 = 0, reverb_pos4 = 0, reverb_pos5 = 0;
-static Sint16 chorus_buffer1[CHORUS_DELAY_1] = {0};
-static Sint16 chorus_buffer2[CHORUS_DELAY_2] = {0};
-static Sint16 chorus_buffer3[CHORUS_DELAY_3] = {0};
-static int chorus_pos1 = 0, chorus_pos2 = 0, chorus_pos3 = 0;
-static Sint16 stereo_buffer[STEREO_DELAY] = {0};
-static int stereo_pos = 0;
-
-static float vibrato_phase = 0.0f;
-static float tremolo_phase = 0.0f;
-static float chorus_phase1 = 0.5f;
-static float chorus_phase2 = 0.5f;
-static float chorus_phase3 = 0.0f;
-static float reverb_level = 0.5f;
-static float reverb_feedback = 0.5f;
-static float reverb_damping = 0.6f;
-static float chorus_level = 0.5f;
-static float chorus_depth = 0.7f;
-static float chorus_speed = 3.0f;
-static float stereo_width = 0.55f;
-static float global_volume = 0.65f;
-static float limiter_threshold = 0.98f;
-static int limiter_enabled = 1;
-static int reverb_enabled = 1;
-static int chorus_enabled = 1;
-static int stereo_enabled = 1;
-static int vibrato_enabled = 1;
-static int tremolo_enabled = 1;
-static int echo_enabled = 1;
-
-static int use_arb_sync = -1;
+#define AUDIO_BUFFER_FRAMES 1024 // буфер SDL_mixer по умолчанию (~23 мс)
+#define AUDIO_LOW_LATENCY_FRAMES 256 // --low-latency (~5.8 мс)
+#define AUDIO_MIN_BUFFER_FRAMES 128
+#define AUDIO_MAX_BUFFER_FRAMES 4096
+#define AUDIO_BLOCK_FRAMES 1024  // внутренний блок обработки во float
+#define MAX_SAMPLE_RATE 192000
+#define TRACK_CACHE_HEADROOM 4.0f // кэш хранит выход цепочки до лимитера, ослабленный в столько раз (-12 dB)
+
+typedef struct {
+    float* data;
+    int mask; // размер - 1, размер — степень двойки
+    int pos;  // куда будет записан следующий отсчёт
+} DelayLine;
+
+// Формат, полученный от устройства (или от входного файла в --bench)
+static struct {
+    int sample_rate;
+    int buffer_frames;
+} audio_format;
+
+// Стадии цепочки эффектов; порядок обработки задаётся EffectParams.order
+typedef enum { STAGE_ECHO, STAGE_REVERB, STAGE_CHORUS, STAGE_VIBRATO, STAGE_TREMOLO, STAGE_STEREO, STAGE_COUNT } StageId;
+
+static const char* stage_names[STAGE_COUNT] = { "echo", "reverb", "chorus", "vibrato", "tremolo", "stereo" };
+
+typedef struct {
+    float reverb_level;
+    float reverb_feedback;
+    float reverb_damping;
+    float chorus_level;
+    float chorus_depth;
+    float chorus_speed;
+    float stereo_width;
+    float global_volume;
+    float limiter_threshold;
+    int limiter_enabled;
+    int reverb_enabled;
+    int chorus_enabled;
+    int stereo_enabled;
+    int vibrato_enabled;
+    int tremolo_enabled;
+    int echo_enabled;
+    Uint8 order[STAGE_COUNT];
+    int chain_bypass; // трек из кэша: эффекты уже в звуке, вживую только громкость и лимитер
+} EffectParams;
+
+// Копия главного потока: правится свободно, в аудиопоток попадает только через effect_params_publish()
+static EffectParams effect_params = {
+    .reverb_level = 0.5f, .reverb_feedback = 0.5f, .reverb_damping = 0.6f,
+    .chorus_level = 0.5f, .chorus_depth = 0.7f, .chorus_speed = 3.0f,
+    .stereo_width = 0.55f, .global_volume = 0.65f, .limiter_threshold = 0.98f,
+    .limiter_enabled = 1, .reverb_enabled = 1, .chorus_enabled = 1, .stereo_enabled = 1,
+    .vibrato_enabled = 1, .tremolo_enabled = 1, .echo_enabled = 1,
+    .order = { STAGE_ECHO, STAGE_REVERB, STAGE_CHORUS, STAGE_VIBRATO, STAGE_TREMOLO, STAGE_STEREO }
+};
+
+/*
+    Тройной буфер параметров между главным потоком и аудиоколбэком, без блокировок и ожиданий.
+    Писатель заполняет свой буфер и атомарно меняет его местами со средним (бит FRESH = есть новое),
+    читатель раз в блок забирает средний, если он свежий. Каждая сторона делает одну атомарную операцию,
+    буферы никогда не используются двумя потоками одновременно, поэтому рваных обновлений нет.
+*/
+
+#define PARAMS_FRESH 4
+
+static EffectParams params_buffers[3];
+static SDL_atomic_t params_middle;   // индекс среднего буфера | PARAMS_FRESH
+static int params_write_index = 0;   // принадлежит главному потоку
+static int params_read_index = 1;    // принадлежит аудиопотоку
+static const EffectParams* audio_params = &params_buffers[1]; // снимок аудиопотока для текущего колбэка
+
+void effect_params_init() {
+    for (int i = 0; i < 3; i++) { params_buffers[i] = effect_params; }
+
+    params_write_index = 0;
+    params_read_index = 1;
+    SDL_AtomicSet(&params_middle, 2);
+    audio_params = &params_buffers[params_read_index];
+}
+
+// Главный поток: опубликовать effect_params
+void effect_params_publish() {
+    params_buffers[params_write_index] = effect_params;
+    SDL_MemoryBarrierRelease();
+    params_write_index = SDL_AtomicSet(&params_middle, params_write_index | PARAMS_FRESH) & 3;
+}
+
+// Аудиопоток: в начале блока подхватить свежий снимок, если он есть
+static const EffectParams* effect_params_acquire() {
+    if (SDL_AtomicGet(&params_middle) & PARAMS_FRESH) {
+        params_read_index = SDL_AtomicSet(&params_middle, params_read_index) & 3;
+        SDL_MemoryBarrierAcquire();
+        audio_params = &params_buffers[params_read_index];
+    }
+
+    return audio_params;
+}
+
+static struct { const char* name; int* enabled; } effect_switches[] = {
+    {"Echo", &effect_params.echo_enabled}, {"Reverb", &effect_params.reverb_enabled},
+    {"Chorus", &effect_params.chorus_enabled}, {"Vibrato", &effect_params.vibrato_enabled},
+    {"Tremolo", &effect_params.tremolo_enabled}, {"Stereo", &effect_params.stereo_enabled},
+    {"Limiter", &effect_params.limiter_enabled}
+};
+
+#define EFFECT_SWITCH_COUNT (int)(sizeof(effect_switches) / sizeof(effect_switches[0]))
+
+static int stage_enabled(const EffectParams* p, StageId id) {
+    switch (id) {
+        case STAGE_ECHO: return p->echo_enabled;
+
+        case STAGE_REVERB: return p->reverb_enabled;
+
+        case STAGE_CHORUS: return p->chorus_enabled;
+
+        case STAGE_VIBRATO: return p->vibrato_enabled;
+
+        case STAGE_TREMOLO: return p->tremolo_enabled;
+
+        case STAGE_STEREO: return p->stereo_enabled;
+
+        default: return 0;
+    }
+}
+
+// "stereo,echo,..." -> порядок стадий; не перечисленные добавляются в порядке по умолчанию
+int effect_order_parse(const char* text, Uint8* order) {
+    int used[STAGE_COUNT] = {0}, count = 0;
+    const char* p = text;
+
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        int found = -1;
+
+        for (int id = 0; id < STAGE_COUNT; id++) {
+            if (strlen(stage_names[id]) == len && strncmp(p, stage_names[id], len) == 0) { found = id; }
+        }
+
+        if (found < 0 || used[found]) {
+            fprintf(stderr, "Bad effect order: %s (stages: echo, reverb, chorus, vibrato, tremolo, stereo)\n", text);
+            return 0;
+        }
+
+        used[found] = 1;
+        order[count++] = found;
+        p += len + (p[len] == ',');
+    }
+
+    for (int id = 0; id < STAGE_COUNT; id++) {
+        if (!used[id]) { order[count++] = id; }
+    }
+
+    return 1;
+}
+
 static int sun_enabled = 1;
 
 typedef struct { float r, g, b; } Color;
@@ -420,28 +559,69 @@ static Color manage_color_state(ColorState* cs, float delta_time) {
     return hsv_to_rgb(generate_hsv(cs->current_palette));
 }
 
-const char* vertex_shader_src =
+static Uint64 fnv1a(Uint64 hash, const void* data, size_t size) {
+    const Uint8* bytes = data;
+
+    for (size_t i = 0; i < size; i++) { hash = (hash ^ bytes[i]) * 0x100000001b3ULL; }
+
+    return hash;
+}
+
+/*
+    Шейдеры собираются из начала под версию GLSL и общего тела. GLSL 1.20 (GL 2.1) получает uniform по одному,
+    GLSL 1.40 (GL 3.1+) — блок Scene из UBO в раскладке std140; раскладка совпадает с SceneUniforms.
+    ATTRIBUTE/VARYING/FRAG_COLOR скрывают разницу в ключевых словах. Свои clamp/mix/smoothstep для float
+    нужны только старым драйверам 1.20; в 1.30+ переопределять встроенные функции нельзя.
+    Солнце, параллакс и облака включаются не uniform, а #define SUN/PARALLAX/CLOUDS между началом и телом:
+    у каждого набора эффектов своя программа без ветвлений на пиксель и без мёртвого кода.
+*/
+
+const char* vertex_preamble_120 =
     "#version 120\n"
-    "attribute vec2 position;\n"
-    "varying vec2 uv;\n"
+    "#define ATTRIBUTE attribute\n"
+    "#define VARYING varying\n";
+
+const char* vertex_preamble_140 =
+    "#version 140\n"
+    "#define ATTRIBUTE in\n"
+    "#define VARYING out\n";
+
+const char* fragment_preamble_120 =
+    "#version 120\n"
+    "#define VARYING varying\n"
+    "#define FRAG_COLOR gl_FragColor\n"
+    "uniform float time;\n"
+    "uniform float battery;\n"
+    "uniform vec2 resolution;\n"
+    "uniform vec3 base_color;\n";
+
+const char* fragment_preamble_140 =
+    "#version 140\n"
+    "#define VARYING in\n"
+    "#define FRAG_COLOR frag_color\n"
+    "out vec4 frag_color;\n"
+    "layout(std140) uniform Scene {\n"
+    "    float time;\n"
+    "    float battery;\n"
+    "    vec2 resolution;\n"
+    "    vec3 base_color;\n"
+    "};\n";
+
+const char* vertex_shader_src =
+    "ATTRIBUTE vec2 position;\n"
+    "VARYING vec2 uv;\n"
     "void main() {\n"
     "    gl_Position = vec4(position, 0.0, 1.0);\n"
     "    uv = position * 0.5 + 0.5;\n"
     "}\n";
 
 const char* fragment_shader_src =
-    "#version 120\n"
-    "varying vec2 uv;\n"
-    "uniform float time;\n"
-    "uniform float battery;\n"
-    "uniform vec2 resolution;\n"
-    "uniform int sun_enabled;\n"
-    "uniform int parallax_enabled;\n"
-    "uniform int clouds_enabled;\n"
-    "uniform vec3 base_color;\n"
+    "VARYING vec2 uv;\n"
+    "#if __VERSION__ < 130\n"
     "float clamp(float x, float minVal, float maxVal) { return min(max(x, minVal), maxVal); }\n"
     "float mix(float x, float y, float a) { return x * (1.0 - a) + y * a; }\n"
     "float smoothstep(float edge0, float edge1, float x) { float t = clamp((x - edge0) / (edge1 - edge0), 0.0, 1.0); return t * t * (3.0 - 2.0 * t); }\n"
+    "#endif\n"
     "float sun_effect(float u, float v) {\n"
     "    float len = sqrt(u * u + v * v);\n"
     "    float val = smoothstep(0.3, 0.29, len);\n"
@@ -479,35 +659,300 @@ const char* fragment_shader_src =
     "    float fog = smoothstep(0.1, -0.02, abs(uv.y + 0.2));\n"
     "    float r = base_color.r, g = base_color.g, b = base_color.b;\n"
     "    vec2 final_uv = uv;\n"
-    "    if (parallax_enabled == 1) {\n"
-    "        vec2 view_dir = vec2(0.1, 0.2);\n"
-    "        float height = heightmap(uv);\n"
-    "        float parallax_scale = 0.15;\n"
-    "        vec2 offset = view_dir * (height - 0.5) * parallax_scale;\n"
-    "        final_uv = uv + offset;\n"
-    "    }\n"
+    "#ifdef PARALLAX\n"
+    "    vec2 view_dir = vec2(0.1, 0.2);\n"
+    "    float height = heightmap(uv);\n"
+    "    float parallax_scale = 0.15;\n"
+    "    vec2 offset = view_dir * (height - 0.5) * parallax_scale;\n"
+    "    final_uv = uv + offset;\n"
+    "#endif\n"
     "    if (final_uv.y < -0.2) {\n"
     "        final_uv.y = 3.0 / (abs(final_uv.y + 0.2) + 0.05); final_uv.x *= final_uv.y;\n"
     "        float gridVal = grid_effect(final_uv.x, final_uv.y);\n"
     "        r = mix(r, 1.0, gridVal); g = mix(g, 0.5, gridVal); b = mix(b, 1.0, gridVal);\n"
-    "    } else if (sun_enabled == 1) {\n"
+    "    }\n"
+    "#ifdef SUN\n"
+    "    else {\n"
     "        final_uv.y -= battery * 1.1 - 0.51;\n"
     "        float sunVal = sun_effect(final_uv.x + 0.95, final_uv.y + 0.02);\n"
     "        r = mix(r, 1.0, sunVal); g = mix(g, 0.4, sunVal); b = mix(b, 0.1, sunVal);\n"
     "    }\n"
-    "    if (clouds_enabled == 1 && final_uv.y > -0.2) {\n"
+    "#endif\n"
+    "#ifdef CLOUDS\n"
+    "    if (final_uv.y > -0.2) {\n"
     "        float cloud_val = clouds(final_uv);\n"
     "        r = mix(r, 0.9, cloud_val); g = mix(g, 0.9, cloud_val); b = mix(b, 0.95, cloud_val);\n"
     "    }\n"
+    "#endif\n"
     "    r = mix(r, 0.5, fog * fog * fog); g = mix(g, 0.5, fog * fog * fog); b = mix(b, 0.5, fog * fog * fog);\n"
-    "    gl_FragColor = vec4(clamp(r, 0.0, 1.0), clamp(g, 0.0, 1.0), clamp(b, 0.0, 1.0), 1.0);\n"
+    "    FRAG_COLOR = vec4(clamp(r, 0.0, 1.0), clamp(g, 0.0, 1.0), clamp(b, 0.0, 1.0), 1.0);\n"
     "}\n";
 
-typedef struct { GLuint shader_program, vao, vbo; } GLData;
+/*
+    Состояние рендера: значения uniform за кадр в SceneUniforms (раскладка std140, она же содержимое UBO),
+    расположения uniform — один раз после линковки, поддержка ARB_sync — один раз при инициализации.
+    Отправляются только изменившиеся значения: по одному glUniform* на путь 1.20 или один glBufferSubData
+    на диапазон изменившихся байт в UBO.
+*/
+
+typedef struct {
+    float time;             // 0
+    float battery;          // 4
+    float resolution[2];    // 8
+    float base_color[3];    // 16
+    float padding;          // блок std140 кратен 16 байтам
+} SceneUniforms;
+
+_Static_assert(offsetof(SceneUniforms, base_color) == 16 && sizeof(SceneUniforms) == 32, "SceneUniforms must match std140");
+
+enum { UNIFORM_FLOAT, UNIFORM_VEC2, UNIFORM_VEC3 };
+
+static const struct { const char* name; size_t offset, size; int type; } scene_uniforms[] = {
+    { "time", offsetof(SceneUniforms, time), 4, UNIFORM_FLOAT },
+    { "battery", offsetof(SceneUniforms, battery), 4, UNIFORM_FLOAT },
+    { "resolution", offsetof(SceneUniforms, resolution), 8, UNIFORM_VEC2 },
+    { "base_color", offsetof(SceneUniforms, base_color), 12, UNIFORM_VEC3 },
+};
+
+#define SCENE_UNIFORM_COUNT (int)(sizeof(scene_uniforms) / sizeof(scene_uniforms[0]))
+#define SCENE_UBO_BINDING 0
+
+typedef struct {
+    GLint locations[SCENE_UNIFORM_COUNT]; // путь 1.20, выбранной программы
+    GLuint ubo;                           // путь 1.40; 0 — нет
+    SceneUniforms uploaded;               // что уже в программе или UBO
+    int uploaded_valid;
+    int has_sync;                         // GL_ARB_sync (или GL 3.2)
+    int has_timer;                        // GL_ARB_timer_query (или GL 3.3)
+} RenderState;
+
+/*
+    Кадры в полёте: после отрисовки в кольцо на FRAMES_IN_FLIGHT мест ставится fence, а ждём только fence кадра,
+    отправленного FRAMES_IN_FLIGHT кадров назад. CPU готовит следующий кадр, пока GPU рисует текущий, и очередь
+    драйвера не растёт. Время кадра на GPU — запросы GL_TIME_ELAPSED в своём кольце; результат забирается без
+    ожидания, когда готов (обычно через 1–2 кадра). Без таймеров время оценивается по CPU (отправка плюс ожидание
+    fence), без ARB_sync — glFinish после каждого кадра, как раньше.
+*/
+
+#define FRAMES_IN_FLIGHT 2
+#define GPU_TIMER_QUERIES (FRAMES_IN_FLIGHT + 2)
+
+typedef struct {
+    GLsync fences[FRAMES_IN_FLIGHT];
+    GLuint queries[GPU_TIMER_QUERIES];
+    int query_head, query_count; // отправленные, но не прочитанные: query_count штук с query_head по кругу
+    int query_active;
+    Uint64 frame;
+    Uint64 start;
+    float gpu_time;              // мс, последний известный кадр
+} FramePipeline;
+
+/*
+    Динамическое разрешение: сцена рисуется в FBO размером scale от окна и растягивается на окно одним
+    glBlitFramebuffer с линейной фильтрацией. Время шейдера почти пропорционально числу пикселей, то есть
+    scale^2, поэтому раз в SCALE_INTERVAL кадров масштаб подбирается так, чтобы среднее время GPU заняло
+    SCALE_TARGET бюджета кадра. Вниз — сразу до нужного шага, вверх — по одному шагу, когда следующий шаг
+    укладывается в цель. Масштаб квантован шагом SCALE_STEP, FBO перевыделяется только при смене шага или окна.
+    При масштабе 1 рисуем прямо в окно. Авто работает только с таймерами GPU (оценка по CPU включает ожидания);
+    клавиша R фиксирует масштаб вручную. Нужен GL 3.0 или ARB_framebuffer_object.
+*/
+
+#define SCALE_MIN 0.5f
+#define SCALE_STEP 0.05f
+#define SCALE_TARGET 0.8f
+#define SCALE_INTERVAL 30
+
+typedef struct {
+    GLuint fbo, color;
+    int width, height;   // размер FBO
+    int window_width, window_height;
+    float scale;         // доля стороны окна
+    float manual;        // 0 — авто
+    float gpu_sum;
+    int samples;
+    int supported;
+} ResolutionScaler;
+
+/*
+    Варианты шейдера: программа на каждый набор флагов SHADER_*, в таблице по битовой маске. Вариант
+    собирается при первом обращении; после первого кадра shader_variants_prewarm собирает по одному
+    недостающему за кадр, начиная с соседних (одна клавиша от текущего), и рисует им один пиксель, чтобы
+    переключение не ждало компиляции. Вариант, который не собрался, не повторяется — остаётся прежняя программа.
+*/
+
+#define SHADER_SUN 1
+#define SHADER_PARALLAX 2
+#define SHADER_CLOUDS 4
+#define SHADER_VARIANTS 8
+
+typedef struct {
+    GLuint program;
+    GLint locations[SCENE_UNIFORM_COUNT]; // путь 1.20
+    int failed;
+} ShaderVariant;
+
+typedef struct {
+    GLuint vao, vbo;
+    ShaderVariant variants[SHADER_VARIANTS];
+    int features;                         // SHADER_*, задаёт main
+    int current;                          // вариант, которым рисовали последний кадр
+    RenderState render;
+    FramePipeline frames;
+    ResolutionScaler scaler;
+} GLData;
+
+/*
+    Кэш собранных программ на диске (GL 4.1 / ARB_get_program_binary): glGetProgramBinary после сборки из
+    исходников, glProgramBinary при следующем запуске. Ключ — FNV-1a от всех исходников и define варианта,
+    а также GL_VENDOR/GL_RENDERER/GL_VERSION/GL_SHADING_LANGUAGE_VERSION: новый драйвер или изменённый шейдер
+    дают другой ключ, старые файлы просто не находятся. Файл с чужим заголовком, обрезанный или отвергнутый
+    драйвером удаляется, программа собирается из исходников и записывается заново (временный файл + rename).
+    Каталог — общий с кэшем треков. --no-cache выключает и этот кэш.
+*/
+
+#define PROGRAM_CACHE_DIR ".wavepixel_cache"
+#define PROGRAM_CACHE_MAGIC 0x42505057u // "WPPB"
+#define PROGRAM_CACHE_VERSION 1
+
+typedef struct {
+    Uint32 magic, version;
+    Uint64 key;
+    Uint32 format, length;
+} ProgramCacheHeader;
+
+static struct {
+    int enabled;
+    Uint64 driver_hash;
+    int loaded, compiled, rejected;
+} program_cache;
+
+// Вызывать с текущим контекстом GL, до init_gl
+void program_cache_init(int enabled) {
+    GLint formats = 0;
+    const char* driver[] = { (const char*)glGetString(GL_VENDOR), (const char*)glGetString(GL_RENDERER),
+                             (const char*)glGetString(GL_VERSION), (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION) };
+
+    memset(&program_cache, 0, sizeof(program_cache));
+
+    if (!enabled) { return; }
+
+    if (!(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)) {
+        printf("Program cache: unavailable (no ARB_get_program_binary)\n");
+        return;
+    }
+
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+    if (formats <= 0) {
+        printf("Program cache: unavailable (driver offers no binary formats)\n");
+        return;
+    }
+
+    program_cache.driver_hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < 4; i++) {
+        const char* text = driver[i] ? driver[i] : "";
+        program_cache.driver_hash = fnv1a(program_cache.driver_hash, text, strlen(text) + 1);
+    }
+
+#ifdef _WIN32
+    CreateDirectoryA(PROGRAM_CACHE_DIR, NULL);
+#else
+    mkdir(PROGRAM_CACHE_DIR, 0755);
+#endif
+
+    program_cache.enabled = 1;
+    printf("Program cache: %s/\n", PROGRAM_CACHE_DIR);
+}
+
+static Uint64 program_cache_key(const char* const* sources, int count) {
+    Uint64 key = program_cache.driver_hash;
+
+    for (int i = 0; i < count; i++) { key = fnv1a(key, sources[i], strlen(sources[i]) + 1); }
+
+    return key;
+}
+
+static void program_cache_path(Uint64 key, char* path, size_t size) {
+    snprintf(path, size, "%s/%016llx.program", PROGRAM_CACHE_DIR, (unsigned long long)key);
+}
+
+// Программа из кэша или 0; негодный файл удаляется
+static GLuint program_cache_load(Uint64 key) {
+    char path[256];
+    program_cache_path(key, path, sizeof(path));
+    FILE* f = fopen(path, "rb");
+
+    if (!f) { return 0; }
+
+    ProgramCacheHeader header;
+    void* binary = NULL;
+    GLuint program = 0;
 
-GLuint compile_shader(GLenum type, const char* source) {
+    if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == PROGRAM_CACHE_MAGIC && header.version == PROGRAM_CACHE_VERSION &&
+        header.key == key && header.length > 0 && (binary = malloc(header.length)) && fread(binary, 1, header.length, f) == header.length) {
+        GLint success = 0;
+        program = glCreateProgram();
+        glProgramBinary(program, header.format, binary, header.length);
+        glGetProgramiv(program, GL_LINK_STATUS, &success);
+
+        if (!success) {
+            glDeleteProgram(program);
+            program = 0;
+        }
+    }
+
+    free(binary);
+    fclose(f);
+
+    if (!program) {
+        remove(path);
+        program_cache.rejected++;
+    }
+
+    return program;
+}
+
+static void program_cache_store(Uint64 key, GLuint program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+
+    if (length <= 0) { return; }
+
+    void* binary = malloc(length);
+    ProgramCacheHeader header = { PROGRAM_CACHE_MAGIC, PROGRAM_CACHE_VERSION, key, 0, 0 };
+    GLenum format = 0;
+    GLsizei written = 0;
+
+    if (!binary) { return; }
+
+    glGetProgramBinary(program, length, &written, &format, binary);
+    header.format = format;
+    header.length = (Uint32)written;
+
+    char path[256], temp[272];
+    program_cache_path(key, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE* f = written > 0 ? fopen(temp, "wb") : NULL;
+
+    if (f) {
+        int ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(binary, 1, written, f) == (size_t)written;
+
+        if (fclose(f) == 0 && ok) {
+            remove(path); // rename на Windows не заменяет существующий файл
+            rename(temp, path);
+        }
+
+        else { remove(temp); }
+    }
+
+    free(binary);
+}
+
+GLuint compile_shader(GLenum type, const char* preamble, const char* defines, const char* source) {
     GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
+    const char* sources[] = { preamble, defines, source };
+    glShaderSource(shader, 3, sources, NULL);
     glCompileShader(shader);
     GLint success;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
@@ -523,12 +968,12 @@ GLuint compile_shader(GLenum type, const char* source) {
     return shader;
 }
 
-GLuint create_shader_program(const char* vertex_src, const char* fragment_src) {
-    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_src);
+GLuint create_shader_program(const char* vertex_preamble, const char* vertex_src, const char* fragment_preamble, const char* defines, const char* fragment_src) {
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_preamble, "", vertex_src);
 
     if (!vertex_shader) { return 0; }
 
-    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_src);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_preamble, defines, fragment_src);
 
     if (!fragment_shader) {
         glDeleteShader(vertex_shader);
@@ -538,6 +983,10 @@ GLuint create_shader_program(const char* vertex_src, const char* fragment_src) {
     GLuint program = glCreateProgram();
     glAttachShader(program, vertex_shader);
     glAttachShader(program, fragment_shader);
+    glBindAttribLocation(program, 0, "position"); // один VAO на все варианты
+
+    if (program_cache.enabled) { glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE); }
+
     glLinkProgram(program);
     GLint success;
     glGetProgramiv(program, GL_LINK_STATUS, &success);
@@ -557,337 +1006,3481 @@ GLuint create_shader_program(const char* vertex_src, const char* fragment_src) {
     return program;
 }
 
-int init_gl(GLData* gl) {
-    gl->shader_program = create_shader_program(vertex_shader_src, fragment_shader_src);
+// Привязать программу к состоянию рендера: блок Scene к UBO или расположения uniform
+static int render_state_link(const RenderState* rs, ShaderVariant* variant) {
+    if (rs->ubo) {
+        GLuint block = glGetUniformBlockIndex(variant->program, "Scene");
 
-    if (!gl->shader_program) { return 0; }
+        if (block == GL_INVALID_INDEX) { return 0; }
 
-    float vertices[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
-    glGenVertexArrays(1, &gl->vao);
-    glGenBuffers(1, &gl->vbo);
-    glBindVertexArray(gl->vao);
-    glBindBuffer(GL_ARRAY_BUFFER, gl->vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    GLint pos_attrib = glGetAttribLocation(gl->shader_program, "position");
+        glUniformBlockBinding(variant->program, block, SCENE_UBO_BINDING);
+        return 1;
+    }
 
-    if (pos_attrib == -1) { return 0; }
+    for (int i = 0; i < SCENE_UNIFORM_COUNT; i++) { variant->locations[i] = glGetUniformLocation(variant->program, scene_uniforms[i].name); }
 
-    glEnableVertexAttribArray(pos_attrib);
-    glVertexAttribPointer(pos_attrib, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
     return 1;
 }
 
-static int first_call = 1;
+// Отправить изменившиеся значения; программа уже выбрана
+static void render_state_upload(RenderState* rs, const SceneUniforms* scene) {
+    size_t first = sizeof(SceneUniforms), last = 0;
 
-void render_scene(GLData* gl, int width, int height, float time, Uint32* render_time, int parallax_enabled, int clouds_enabled) {
-    Uint32 start = SDL_GetTicks();
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glUseProgram(gl->shader_program);
-    glUniform1f(glGetUniformLocation(gl->shader_program, "time"), time);
-    glUniform1f(glGetUniformLocation(gl->shader_program, "battery"), 1.0f);
-    glUniform2f(glGetUniformLocation(gl->shader_program, "resolution"), (float)width, (float)height);
-    glUniform1i(glGetUniformLocation(gl->shader_program, "sun_enabled"), sun_enabled);
-    glUniform1i(glGetUniformLocation(gl->shader_program, "parallax_enabled"), parallax_enabled);
-    glUniform1i(glGetUniformLocation(gl->shader_program, "clouds_enabled"), clouds_enabled);
-    glBindVertexArray(gl->vao);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glBindVertexArray(0);
+    for (int i = 0; i < SCENE_UNIFORM_COUNT; i++) {
+        const void* value = (const char*)scene + scene_uniforms[i].offset;
+
+        if (rs->uploaded_valid && memcmp(value, (const char*)&rs->uploaded + scene_uniforms[i].offset, scene_uniforms[i].size) == 0) { continue; }
+
+        if (rs->ubo) {
+            first = SDL_min(first, scene_uniforms[i].offset);
+            last = SDL_max(last, scene_uniforms[i].offset + scene_uniforms[i].size);
+            continue;
+        }
 
-    int has_arb_sync = glewIsSupported("GL_ARB_sync");
+        switch (scene_uniforms[i].type) {
+            case UNIFORM_FLOAT: glUniform1fv(rs->locations[i], 1, value); break;
 
-    if (use_arb_sync == -1) { use_arb_sync = has_arb_sync; }
+            case UNIFORM_VEC2: glUniform2fv(rs->locations[i], 1, value); break;
 
-    if (use_arb_sync && has_arb_sync) {
-        GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
-        glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 60000000);
-        glDeleteSync(sync);
+            default: glUniform3fv(rs->locations[i], 1, value); break;
+        }
     }
 
-    else {
-        glFinish();
+    if (first < last) {
+        glBindBuffer(GL_UNIFORM_BUFFER, rs->ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER, first, last - first, (const char*)scene + first);
     }
 
-    *render_time = SDL_GetTicks() - start;
+    rs->uploaded = *scene;
+    rs->uploaded_valid = 1;
 }
 
-void stabilize_frame_rate(Uint32 frame_start, Uint32 render_time, float* avg_frame_time, int fullscreen) {
-    const float alpha = 0.05f;
-    *avg_frame_time = (1.0f - alpha) * (*avg_frame_time) + alpha * render_time;
-    float target_fps = fullscreen ? 40.0f : 60.0f;
+// Собрать вариант для набора флагов; 0 если не собирается
+static int shader_variant_build(GLData* gl, int features) {
+    ShaderVariant* variant = &gl->variants[features];
+    char defines[64];
+    snprintf(defines, sizeof(defines), "%s%s%s", features & SHADER_SUN ? "#define SUN\n" : "",
+             features & SHADER_PARALLAX ? "#define PARALLAX\n" : "", features & SHADER_CLOUDS ? "#define CLOUDS\n" : "");
+    const char* sources[] = { gl->render.ubo ? vertex_preamble_140 : vertex_preamble_120, vertex_shader_src,
+                              gl->render.ubo ? fragment_preamble_140 : fragment_preamble_120, defines, fragment_shader_src };
+    Uint64 key = program_cache.enabled ? program_cache_key(sources, 5) : 0;
+    variant->program = program_cache.enabled ? program_cache_load(key) : 0;
 
-    if (*avg_frame_time > 33.3f) { target_fps = fullscreen ? 30.0f : 45.0f; }
+    if (variant->program) { program_cache.loaded++; }
 
-    Uint32 frame_time = SDL_GetTicks() - frame_start;
+    else {
+        variant->program = create_shader_program(sources[0], sources[1], sources[2], sources[3], sources[4]);
+
+        if (variant->program && program_cache.enabled) {
+            program_cache_store(key, variant->program);
+            program_cache.compiled++;
+        }
+    }
 
-    if (frame_time < 1000.0f / target_fps) { SDL_Delay((Uint32)(1000.0f / target_fps - frame_time)); }
+    if (variant->program && !render_state_link(&gl->render, variant)) {
+        glDeleteProgram(variant->program);
+        variant->program = 0;
+    }
+
+    variant->failed = !variant->program;
+    return variant->program != 0;
 }
 
-void audio_effect(void* udata, Uint8* stream, int len) {
-    Sint16* buffer = (Sint16*)stream;
-    int samples = len / sizeof(Sint16);
-    Sint32 max_amplitude = 0;
-
-    for (int i = 0; i < samples; i += 2) {
-        Sint16 left_sample = buffer[i];
-        Sint16 right_sample = buffer[i + 1];
-        left_sample = (Sint16)(left_sample * global_volume);
-        right_sample = (Sint16)(right_sample * global_volume);
-        Sint32 mixed_left = (Sint32)left_sample;
-        Sint32 mixed_right = (Sint32)right_sample;
-
-        if (echo_enabled) {
-            mixed_left += echo_buffer[echo_pos] * 0.3f;
-            mixed_right += echo_buffer[echo_pos] * 0.3f;
-            echo_buffer[echo_pos] = (left_sample + right_sample) / 2;
-            echo_pos = (echo_pos + 1) % ECHO_DELAY;
-        }
+// Собрать один недостающий вариант, ближайший к текущему; 0 — собирать больше нечего
+int shader_variants_prewarm(GLData* gl) {
+    for (int distance = 1; distance <= 3; distance++) {
+        for (int features = 0; features < SHADER_VARIANTS; features++) {
+            ShaderVariant* variant = &gl->variants[features];
+            int bits = features ^ gl->features;
+
+            if (variant->program || variant->failed || (bits & 1) + (bits >> 1 & 1) + (bits >> 2 & 1) != distance) { continue; }
+
+            // Часть драйверов достраивает программу при первой отрисовке: один пиксель сейчас, а не рывок при переключении
+            if (shader_variant_build(gl, features)) {
+                glEnable(GL_SCISSOR_TEST);
+                glScissor(0, 0, 1, 1);
+                glUseProgram(variant->program);
+                glBindVertexArray(gl->vao);
+                glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+                glBindVertexArray(0);
+                glDisable(GL_SCISSOR_TEST);
+            }
 
-        if (reverb_enabled) {
-            Sint16 reverb1 = reverb_buffer1[reverb_pos1] * 0.5f;
-            Sint16 reverb2 = reverb_buffer2[reverb_pos2] * 0.4f;
-            Sint16 reverb3 = reverb_buffer3[reverb_pos3] * 0.3f;
-            Sint16 reverb4 = reverb_buffer4[reverb_pos4] * 0.3f * (1.0f - reverb_damping);
-            Sint16 reverb5 = reverb_buffer5[reverb_pos5] * 0.15f * (1.0f - reverb_damping);
-            Sint32 reverb_sum = (Sint32)(reverb1 + reverb2 + reverb3 + reverb4 + reverb5);
-            mixed_left += reverb_sum * 0.2f;
-            mixed_right += reverb_sum * 0.2f;
-            Sint16 reverb_input = (left_sample + right_sample) / 2 + reverb_sum * reverb_feedback;
-            reverb_buffer1[reverb_pos1] = reverb_input;
-            reverb_pos1 = (reverb_pos1 + 1) % REVERB_DELAY_1;
-            reverb_buffer2[reverb_pos2] = reverb_input;
-            reverb_pos2 = (reverb_pos2 + 1) % REVERB_DELAY_2;
-            reverb_buffer3[reverb_pos3] = reverb_input;
-            reverb_pos3 = (reverb_pos3 + 1) % REVERB_DELAY_3;
-            reverb_buffer4[reverb_pos4] = reverb_input;
-            reverb_pos4 = (reverb_pos4 + 1) % REVERB_DELAY_4;
-            reverb_buffer5[reverb_pos5] = reverb_input;
-            reverb_pos5 = (reverb_pos5 + 1) % REVERB_DELAY_5;
+            return 1;
         }
+    }
 
-        if (chorus_enabled) {
-            int chorus_idx1 = (chorus_pos1 - CHORUS_DELAY_1 + CHORUS_DELAY_1) % CHORUS_DELAY_1;
-            int chorus_idx2 = (chorus_pos2 - CHORUS_DELAY_2 + CHORUS_DELAY_2) % CHORUS_DELAY_2;
-            int chorus_idx3 = (chorus_pos3 - CHORUS_DELAY_3 + CHORUS_DELAY_3) % CHORUS_DELAY_3;
-            float mod1 = 0.5f + chorus_depth * sinf(chorus_phase1);
-            float mod2 = 0.5f + chorus_depth * sinf(chorus_phase2);
-            float mod3 = 0.5f + chorus_depth * sinf(chorus_phase3);
-            Sint16 chorus1 = (Sint16)(chorus_buffer1[chorus_idx1] * mod1 * 0.4f);
-            Sint16 chorus2 = (Sint16)(chorus_buffer2[chorus_idx2] * mod2 * 0.4f);
-            Sint16 chorus3 = (Sint16)(chorus_buffer3[chorus_idx3] * mod3 * 0.3f);
-            mixed_left += (Sint32)(chorus1 + chorus2 + chorus3) * 0.15f;
-            mixed_right += (Sint32)(chorus1 + chorus2 + chorus3) * 0.15f;
-            chorus_buffer1[chorus_pos1] = (left_sample + right_sample) / 2;
-            chorus_pos1 = (chorus_pos1 + 1) % CHORUS_DELAY_1;
-            chorus_buffer2[chorus_pos2] = (left_sample + right_sample) / 2;
-            chorus_pos2 = (chorus_pos2 + 1) % CHORUS_DELAY_2;
-            chorus_buffer3[chorus_pos3] = (left_sample + right_sample) / 2;
-            chorus_pos3 = (chorus_pos3 + 1) % CHORUS_DELAY_3;
-            chorus_phase1 += 2 * M_PI * chorus_speed / SAMPLE_RATE;
+    return 0;
+}
 
-            if (chorus_phase1 > 2 * M_PI) { chorus_phase1 -= 2 * M_PI; }
+void shader_variants_destroy(GLData* gl) {
+    for (int i = 0; i < SHADER_VARIANTS; i++) {
+        if (gl->variants[i].program) { glDeleteProgram(gl->variants[i].program); }
+    }
 
-            chorus_phase2 += 2 * M_PI * chorus_speed / SAMPLE_RATE;
+    memset(gl->variants, 0, sizeof(gl->variants));
+}
 
-            if (chorus_phase2 > 2 * M_PI) { chorus_phase2 -= 2 * M_PI; }
+int init_gl(GLData* gl) {
+    RenderState* rs = &gl->render;
+    rs->has_sync = GLEW_VERSION_3_2 || glewIsSupported("GL_ARB_sync");
+    rs->has_timer = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
 
-            chorus_phase3 += 2 * M_PI * chorus_speed / SAMPLE_RATE;
+    if (rs->has_timer) { glGenQueries(GPU_TIMER_QUERIES, gl->frames.queries); }
 
-            if (chorus_phase3 > 2 * M_PI) { chorus_phase3 -= 2 * M_PI; }
-        }
+    gl->scaler.scale = 1.0f;
+    gl->scaler.supported = GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object;
 
-        if (vibrato_enabled) {
-            float vibrato = sinf(vibrato_phase) * 0.03f;
-            mixed_left = (Sint32)(mixed_left * (1.0f + vibrato));
-            mixed_right = (Sint32)(mixed_right * (1.0f + vibrato));
-            vibrato_phase += 2 * M_PI * 3.0f / SAMPLE_RATE;
+    if (gl->scaler.supported) {
+        glGenFramebuffers(1, &gl->scaler.fbo);
+        glGenRenderbuffers(1, &gl->scaler.color);
+    }
 
-            if (vibrato_phase > 2 * M_PI) { vibrato_phase -= 2 * M_PI; }
+    // GL 3.1+: uniform-блок; если драйвер не собрал 1.40 — обычные uniform
+    if (GLEW_VERSION_3_1) {
+        glGenBuffers(1, &rs->ubo);
+
+        if (shader_variant_build(gl, gl->features)) {
+            GLuint program = gl->variants[gl->features].program;
+            GLint size = 0;
+            glGetActiveUniformBlockiv(program, glGetUniformBlockIndex(program, "Scene"), GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+            glBindBuffer(GL_UNIFORM_BUFFER, rs->ubo);
+            glBufferData(GL_UNIFORM_BUFFER, SDL_max(size, (GLint)sizeof(SceneUniforms)), NULL, GL_DYNAMIC_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER, SCENE_UBO_BINDING, rs->ubo);
         }
 
-        if (tremolo_enabled) {
-            float tremolo = 0.85f + 0.075f * sinf(tremolo_phase);
-            mixed_left = (Sint32)(mixed_left * tremolo);
-            mixed_right = (Sint32)(mixed_right * tremolo);
-            tremolo_phase += 2 * M_PI * 3.0f / SAMPLE_RATE;
-
-            if (tremolo_phase > 2 * M_PI) { tremolo_phase -= 2 * M_PI; }
+        else {
+            glDeleteBuffers(1, &rs->ubo);
+            rs->ubo = 0;
+            gl->variants[gl->features].failed = 0;
         }
+    }
 
-        if (stereo_enabled) {
-            Sint16 stereo_delayed = stereo_buffer[stereo_pos];
-            mixed_left += (Sint32)(stereo_delayed * 0.5f);
-            mixed_right += (Sint32)(stereo_delayed * -0.5f);
-            stereo_buffer[stereo_pos] = (left_sample + right_sample) / 2;
-            stereo_pos = (stereo_pos + 1) % STEREO_DELAY;
-        }
+    if (!gl->variants[gl->features].program && !shader_variant_build(gl, gl->features)) { return 0; }
 
-        max_amplitude = abs(mixed_left) > max_amplitude ? abs(mixed_left) : max_amplitude;
-        max_amplitude = abs(mixed_right) > max_amplitude ? abs(mixed_right) : max_amplitude;
-        buffer[i] = (Sint16)mixed_left;
-        buffer[i + 1] = (Sint16)mixed_right;
-    }
+    gl->current = gl->features;
+    memcpy(rs->locations, gl->variants[gl->current].locations, sizeof(rs->locations));
 
-    if (max_amplitude > 32767) {
-        float scale = 32767.0f / max_amplitude;
+    printf("Renderer: %s, GLSL %s, uniforms via %s, frame time from %s\n", (const char*)glGetString(GL_RENDERER),
+           rs->ubo ? "1.40" : "1.20", rs->ubo ? "uniform buffer" : "glUniform", rs->has_timer ? "GPU timer queries" : "CPU clock");
 
-        for (int i = 0; i < samples; i += 2) {
-            buffer[i] = (Sint16)(buffer[i] * scale);
-            buffer[i + 1] = (Sint16)(buffer[i + 1] * scale);
-        }
-    }
+    float vertices[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+    glGenVertexArrays(1, &gl->vao);
+    glGenBuffers(1, &gl->vbo);
+    glBindVertexArray(gl->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gl->vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+    return 1;
 }
 
-typedef struct {
-    char** files;
-    int count;
-    int capacity;
-} MidiList;
+static int first_call = 1;
 
-MidiList* midi_list_init() {
-    MidiList* list = malloc(sizeof(MidiList));
-    list->count = 0;
-    list->capacity = 10;
-    list->files = malloc(list->capacity * sizeof(char*));
-    return list;
-}
+// Дождаться кадра, занимавшего это место в кольце, забрать готовые замеры GPU и начать новый
+static void frame_pipeline_begin(FramePipeline* fp, const RenderState* rs) {
+    GLsync* fence = &fp->fences[fp->frame % FRAMES_IN_FLIGHT];
+    fp->start = SDL_GetPerformanceCounter();
 
-void midi_list_add(MidiList* list, const char* filename) {
-    for (int i = 0; i < list->count; i++) {
-        if (strcmp(list->files[i], filename) == 0) { return; }
+    if (*fence) {
+        glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 60000000);
+        glDeleteSync(*fence);
+        *fence = NULL;
     }
 
-    if (list->count >= list->capacity) {
-        list->capacity *= 2;
-        list->files = realloc(list->files, list->capacity * sizeof(char*));
-    }
+    while (fp->query_count > 0) {
+        GLuint query = fp->queries[fp->query_head];
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
 
-    list->files[list->count++] = strdup(filename);
-}
+        if (!available) { break; }
 
-void midi_list_free(MidiList* list) {
-    if (list) {
-        for (int i = 0; i < list->count; i++) { free(list->files[i]); }
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
 
-        free(list->files);
-        free(list);
-    }
-}
+        // Первый замер в контексте у некоторых драйверов (Mesa llvmpipe) — мусор; кадр дольше секунды не бывает
+        if (elapsed < 1000000000ull) { fp->gpu_time = elapsed / 1000000.0f; }
 
-#ifdef _WIN32
-    #include <windows.h>
-    #define STRDUP _strdup
-    #define DIR_SCAN_TYPE WIN32_FIND_DATA
-    #define DIR_OPEN(dir) FindFirstFile("*.mid", &dir)
-    #define DIR_NEXT(hFind, fd) FindNextFile(hFind, &fd)
-    #define DIR_CLOSE(hFind) FindClose(hFind)
-    #define DIR_VALID(hFind) (hFind != INVALID_HANDLE_VALUE)
-    #define DIR_NAME(fd) fd.cFileName
-    #define IS_DIR(fd) (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-#else
-    #include <dirent.h>
-    #define STRDUP strdup
-    #define DIR_SCAN_TYPE struct dirent
-    #define DIR_OPEN(dir) opendir(".")
-    #define DIR_NEXT(dir, entry) (entry = readdir(dir))
-    #define DIR_CLOSE(dir) closedir(dir)
-    #define DIR_VALID(dir) (dir != NULL)
-    #define DIR_NAME(entry) entry->d_name
-    #define IS_DIR(entry) (entry->d_type == DT_DIR)
-#endif
+        fp->query_head = (fp->query_head + 1) % GPU_TIMER_QUERIES;
+        fp->query_count--;
+    }
 
-void update_midi_list(MidiList* list) {
-    MidiList* new_list = midi_list_init();
-#ifdef _WIN32
-    WIN32_FIND_DATA fd;
-    HANDLE hFind = DIR_OPEN(fd);
+    // Кольцо запросов занято (драйвер отстаёт от fence) — этот кадр без замера
+    fp->query_active = rs->has_timer && fp->query_count < GPU_TIMER_QUERIES;
 
-    if (DIR_VALID(hFind)) {
-        do {
-            if (!IS_DIR(fd)) { midi_list_add(new_list, DIR_NAME(fd)); }
-        }
-        while (DIR_NEXT(hFind, fd));
+    if (fp->query_active) { glBeginQuery(GL_TIME_ELAPSED, fp->queries[(fp->query_head + fp->query_count) % GPU_TIMER_QUERIES]); }
+}
 
-        DIR_CLOSE(hFind);
+static void frame_pipeline_end(FramePipeline* fp, const RenderState* rs) {
+    if (fp->query_active) {
+        glEndQuery(GL_TIME_ELAPSED);
+        fp->query_count++;
     }
 
-#else
-    DIR* dir = DIR_OPEN(dir);
-
-    if (DIR_VALID(dir)) {
-        struct dirent* entry;
-
-        while (DIR_NEXT(dir, entry)) {
-            if (strstr(DIR_NAME(entry), ".mid")) { midi_list_add(new_list, DIR_NAME(entry)); }
-        }
+    if (rs->has_sync) { fp->fences[fp->frame % FRAMES_IN_FLIGHT] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0); }
 
-        DIR_CLOSE(dir);
+    else {
+        glFinish();
     }
 
-#endif
-
-    for (int i = 0; i < list->count; i++) { free(list->files[i]); }
+    if (!rs->has_timer) { fp->gpu_time = (SDL_GetPerformanceCounter() - fp->start) * 1000.0f / SDL_GetPerformanceFrequency(); }
 
-    free(list->files);
-    list->files = new_list->files;
-    list->count = new_list->count;
-    list->capacity = new_list->capacity;
-    free(new_list);
+    fp->frame++;
+}
+
+void frame_pipeline_destroy(FramePipeline* fp, const RenderState* rs) {
+    for (int i = 0; i < FRAMES_IN_FLIGHT; i++) {
+        if (fp->fences[i]) { glDeleteSync(fp->fences[i]); }
+    }
+
+    if (rs->has_timer) { glDeleteQueries(GPU_TIMER_QUERIES, fp->queries); }
+
+    memset(fp, 0, sizeof(*fp));
+}
+
+// Выбрать, куда рисовать кадр: 1 — в FBO (потом resolution_scaler_present), 0 — прямо в окно
+static int resolution_scaler_bind(ResolutionScaler* rs, int width, int height) {
+    rs->window_width = width;
+    rs->window_height = height;
+
+    if (!rs->supported || rs->scale >= 1.0f) {
+        if (rs->supported) { glBindFramebuffer(GL_FRAMEBUFFER, 0); }
+
+        glViewport(0, 0, width, height);
+        return 0;
+    }
+
+    int scaled_width = SDL_max(1, (int)(width * rs->scale + 0.5f)), scaled_height = SDL_max(1, (int)(height * rs->scale + 0.5f));
+    glBindFramebuffer(GL_FRAMEBUFFER, rs->fbo);
+
+    if (scaled_width != rs->width || scaled_height != rs->height) {
+        glBindRenderbuffer(GL_RENDERBUFFER, rs->color);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, scaled_width, scaled_height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rs->color);
+        rs->width = scaled_width;
+        rs->height = scaled_height;
+    }
+
+    glViewport(0, 0, rs->width, rs->height);
+    return 1;
+}
+
+static void resolution_scaler_present(const ResolutionScaler* rs) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, rs->fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, rs->width, rs->height, 0, 0, rs->window_width, rs->window_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// После кадра: gpu_time — время GPU (мс), budget — период кадра (мс); has_timer — время GPU настоящее
+void resolution_scaler_update(ResolutionScaler* rs, float gpu_time, double budget, int has_timer) {
+    if (!rs->supported || rs->manual > 0.0f || !has_timer || gpu_time <= 0.0f) { return; }
+
+    rs->gpu_sum += gpu_time;
+
+    if (++rs->samples < SCALE_INTERVAL) { return; }
+
+    float average = rs->gpu_sum / rs->samples;
+    float ideal = rs->scale * sqrtf(SCALE_TARGET * (float)budget / average);
+    rs->gpu_sum = 0.0f;
+    rs->samples = 0;
+
+    if (ideal < rs->scale - SCALE_STEP * 0.5f) { rs->scale = SDL_max(SCALE_MIN, floorf(ideal / SCALE_STEP) * SCALE_STEP); }
+
+    else if (ideal >= rs->scale + SCALE_STEP) { rs->scale = SDL_min(1.0f, rs->scale + SCALE_STEP); }
+}
+
+// Клавиша R: авто -> 100% -> 75% -> 50% -> авто
+void resolution_scaler_cycle(ResolutionScaler* rs) {
+    if (!rs->supported) {
+        printf("Resolution scaling needs OpenGL 3.0 or ARB_framebuffer_object\n");
+        return;
+    }
+
+    rs->manual = rs->manual == 0.0f ? 1.0f : (rs->manual > 0.75f ? 0.75f : (rs->manual > 0.5f ? 0.5f : 0.0f));
+
+    if (rs->manual > 0.0f) { rs->scale = rs->manual; }
+
+    rs->gpu_sum = 0.0f;
+    rs->samples = 0;
+
+    if (rs->manual > 0.0f) { printf("Resolution scale: %.0f%%\n", rs->manual * 100.0f); }
+
+    else {
+        printf("Resolution scale: auto\n");
+    }
+}
+
+void resolution_scaler_report(const ResolutionScaler* rs) {
+    if (!rs->supported) { return; }
+
+    printf("\nResolution scale %.0f%% (%s), %dx%d for %dx%d window\n", rs->scale * 100.0f, rs->manual > 0.0f ? "manual" : "auto",
+           rs->scale < 1.0f ? rs->width : rs->window_width, rs->scale < 1.0f ? rs->height : rs->window_height, rs->window_width, rs->window_height);
+}
+
+void resolution_scaler_destroy(ResolutionScaler* rs) {
+    if (rs->supported) {
+        glDeleteFramebuffers(1, &rs->fbo);
+        glDeleteRenderbuffers(1, &rs->color);
+    }
+
+    memset(rs, 0, sizeof(*rs));
+}
+
+// width, height — размер окна
+void render_scene(GLData* gl, const SceneUniforms* scene, int width, int height) {
+    frame_pipeline_begin(&gl->frames, &gl->render);
+    int scaled = resolution_scaler_bind(&gl->scaler, width, height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Новый набор эффектов: вариант из таблицы (или собрать сейчас); не собрался — рисовать прежним
+    if (gl->features != gl->current && (gl->variants[gl->features].program || (!gl->variants[gl->features].failed && shader_variant_build(gl, gl->features)))) {
+        const ShaderVariant* variant = &gl->variants[gl->features];
+        gl->current = gl->features;
+
+        // uniform хранятся в программе: новой нужны все значения
+        if (!gl->render.ubo) {
+            memcpy(gl->render.locations, variant->locations, sizeof(variant->locations));
+            gl->render.uploaded_valid = 0;
+        }
+    }
+
+    glUseProgram(gl->variants[gl->current].program);
+    render_state_upload(&gl->render, scene);
+    glBindVertexArray(gl->vao);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    glBindVertexArray(0);
+
+    if (scaled) { resolution_scaler_present(&gl->scaler); }
+
+    frame_pipeline_end(&gl->frames, &gl->render);
+}
+
+/*
+    Темп кадров по SDL_GetPerformanceCounter. Режимы: vsync, адаптивный vsync (интервал -1: опоздавший кадр
+    показывается сразу, с разрывом, а не ждёт следующего обновления) и sleep+spin без vsync — SDL_Delay до
+    PACE_SPIN_MS перед сроком, остаток опросом счётчика. Сроки отсчитываются от предыдущего срока, а не от конца
+    кадра, поэтому ошибка одного кадра не накапливается. Без vsync период растёт, если GPU не успевает
+    (среднее время GPU из кольца запросов). delta — реальная длительность прошлого кадра для анимации,
+    не больше PACE_MAX_DELTA: пауза (перетаскивание окна, задержка на паузе) не даёт скачка сцены.
+*/
+
+#define PACE_HISTORY 1024 // степень двойки
+#define PACE_SPIN_MS 2.0
+#define PACE_MAX_DELTA 0.1f
+#define PACE_GPU_HEADROOM 1.1f
+
+enum { PACE_VSYNC, PACE_ADAPTIVE_VSYNC, PACE_SLEEP };
+
+static const char* pace_mode_names[] = { "vsync", "adaptive vsync", "sleep+spin" };
+
+typedef struct {
+    int mode;
+    double period;              // мс: период обновления дисплея или цель sleep+spin
+    double ticks_per_ms;
+    Uint64 last, deadline;
+    float avg_gpu_time;         // мс
+    float history[PACE_HISTORY]; // длительности кадров, мс
+    Uint64 frames;
+} FramePacer;
+
+// Включить режим; если драйвер не умеет — следующий по списку. target_fps 0 — частота дисплея
+void frame_pacer_init(FramePacer* pacer, int mode, float target_fps, SDL_Window* window) {
+    SDL_DisplayMode display;
+    float refresh = 60.0f;
+
+    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &display) == 0 && display.refresh_rate > 0) { refresh = (float)display.refresh_rate; }
+
+    if (mode == PACE_ADAPTIVE_VSYNC && SDL_GL_SetSwapInterval(-1) != 0) { mode = PACE_VSYNC; }
+
+    if (mode == PACE_VSYNC && SDL_GL_SetSwapInterval(1) != 0) {
+        printf("Warning: vsync unavailable (%s), pacing by timer\n", SDL_GetError());
+        mode = PACE_SLEEP;
+    }
+
+    if (mode == PACE_SLEEP) { SDL_GL_SetSwapInterval(0); }
+
+    memset(pacer, 0, sizeof(*pacer));
+    pacer->mode = mode;
+    pacer->period = 1000.0 / (mode == PACE_SLEEP && target_fps > 0.0f ? target_fps : refresh);
+    pacer->ticks_per_ms = SDL_GetPerformanceFrequency() / 1000.0;
+    pacer->last = pacer->deadline = SDL_GetPerformanceCounter();
+    printf("Frame pacing: %s, %.1f fps target\n", pace_mode_names[mode], 1000.0 / pacer->period);
+}
+
+// Начало кадра: реальная длительность прошлого кадра в секундах
+float frame_pacer_begin(FramePacer* pacer) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    float frame_ms = pacer->frames ? (float)((now - pacer->last) / pacer->ticks_per_ms) : (float)pacer->period;
+
+    if (pacer->frames) { pacer->history[(pacer->frames - 1) & (PACE_HISTORY - 1)] = frame_ms; }
+
+    pacer->frames++;
+    pacer->last = now;
+    return SDL_min(frame_ms / 1000.0f, PACE_MAX_DELTA);
+}
+
+// Конец кадра (после SwapWindow); gpu_time — время кадра на GPU (мс), известное на этот момент
+void frame_pacer_wait(FramePacer* pacer, float gpu_time) {
+    const float alpha = 0.05f;
+    pacer->avg_gpu_time = (1.0f - alpha) * pacer->avg_gpu_time + alpha * gpu_time;
+
+    if (pacer->mode != PACE_SLEEP) { return; } // ждёт SwapWindow
+
+    double period = SDL_min(SDL_max(pacer->period, (double)(pacer->avg_gpu_time * PACE_GPU_HEADROOM)), PACE_MAX_DELTA * 1000.0);
+    Uint64 now = SDL_GetPerformanceCounter();
+    pacer->deadline += (Uint64)(period * pacer->ticks_per_ms);
+
+    // Опоздали больше чем на период — не догонять, считать сроки от сейчас
+    if (now > pacer->deadline + (Uint64)(period * pacer->ticks_per_ms)) {
+        pacer->deadline = now;
+        return;
+    }
+
+    if (now >= pacer->deadline) { return; }
+
+    double remaining = (pacer->deadline - now) / pacer->ticks_per_ms;
+
+    if (remaining > PACE_SPIN_MS) { SDL_Delay((Uint32)(remaining - PACE_SPIN_MS)); }
+
+    while (SDL_GetPerformanceCounter() < pacer->deadline) {}
+}
+
+static int float_compare(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+// Перцентили длительности кадра и отклонения от целевого периода (джиттер) по последним кадрам
+void frame_pacer_report(const FramePacer* pacer) {
+    static float times[PACE_HISTORY], jitter[PACE_HISTORY];
+    int n = (int)SDL_min(pacer->frames ? pacer->frames - 1 : 0, (Uint64)PACE_HISTORY);
+
+    if (n == 0) { return; }
+
+    for (int i = 0; i < n; i++) {
+        times[i] = pacer->history[i];
+        jitter[i] = fabsf(pacer->history[i] - (float)pacer->period);
+    }
+
+    qsort(times, n, sizeof(float), float_compare);
+    qsort(jitter, n, sizeof(float), float_compare);
+    printf("\nFrame pacing (%s, %.1f fps target, last %d frames, GPU %.2f ms):\n", pace_mode_names[pacer->mode], 1000.0 / pacer->period, n, pacer->avg_gpu_time);
+    printf("  frame time  p50 %6.2f  p95 %6.2f  p99 %6.2f ms\n", times[n / 2], times[n * 95 / 100], times[n * 99 / 100]);
+    printf("  jitter      p50 %6.2f  p95 %6.2f  p99 %6.2f ms\n", jitter[n / 2], jitter[n * 95 / 100], jitter[n * 99 / 100]);
+}
+
+/*
+    DSP-ядра цепочки эффектов. Каждый эффект — отдельный проход по всему блоку (планарные L/R/mono),
+    поэтому внутренние циклы без ветвлений и % и векторизуются. Набор ядер выбирается при старте:
+    AVX2 -> SSE2 -> скалярный эталон. SIMD-версии повторяют эталон поэлементно, расхождение на выходе
+    не более DSP_TOLERANCE_LSB (разный порядок округления при FMA-сжатии скалярного кода).
+*/
+
+#define DSP_TOLERANCE_LSB 1
+
+typedef struct {
+    const char* name;
+    void (*s16_to_float)(const Sint16* in, float* left, float* right, float* mono, float scale, int n);
+    void (*float_to_s16)(const float* left, const float* right, Sint16* out, float scale, int n);
+    void (*mix_add)(float* dst, const float* src, float gain, int n);          // dst += src * gain
+    void (*mix_mul_add)(float* dst, const float* a, const float* b, float gain, int n); // dst += a * b * gain
+    void (*mul)(float* dst, const float* src, int n);                          // dst *= src
+} DspKernels;
+
+static void s16_to_float_scalar(const Sint16* in, float* left, float* right, float* mono, float scale, int n) {
+    for (int i = 0; i < n; i++) {
+        left[i] = in[i * 2] * scale;
+        right[i] = in[i * 2 + 1] * scale;
+        mono[i] = (left[i] + right[i]) * 0.5f;
+    }
+}
+
+static void float_to_s16_scalar(const float* left, const float* right, Sint16* out, float scale, int n) {
+    for (int i = 0; i < n; i++) {
+        float l = left[i] * scale, r = right[i] * scale;
+        l = l > 32767.0f ? 32767.0f : (l < -32768.0f ? -32768.0f : l);
+        r = r > 32767.0f ? 32767.0f : (r < -32768.0f ? -32768.0f : r);
+        out[i * 2] = (Sint16)l;
+        out[i * 2 + 1] = (Sint16)r;
+    }
+}
+
+static void mix_add_scalar(float* dst, const float* src, float gain, int n) {
+    for (int i = 0; i < n; i++) { dst[i] += src[i] * gain; }
+}
+
+static void mix_mul_add_scalar(float* dst, const float* a, const float* b, float gain, int n) {
+    for (int i = 0; i < n; i++) { dst[i] += a[i] * b[i] * gain; }
+}
+
+static void mul_scalar(float* dst, const float* src, int n) {
+    for (int i = 0; i < n; i++) { dst[i] *= src[i]; }
+}
+
+static const DspKernels dsp_scalar = {
+    "scalar", s16_to_float_scalar, float_to_s16_scalar, mix_add_scalar, mix_mul_add_scalar, mul_scalar
+};
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define DSP_X86 1
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void s16_to_float_sse2(const Sint16* in, float* left, float* right, float* mono, float scale, int n) {
+    __m128 s = _mm_set1_ps(scale), half = _mm_set1_ps(0.5f);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in + i * 2));
+        __m128 l = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(x, 16), 16)), s);
+        __m128 r = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(x, 16)), s);
+        _mm_storeu_ps(left + i, l);
+        _mm_storeu_ps(right + i, r);
+        _mm_storeu_ps(mono + i, _mm_mul_ps(_mm_add_ps(l, r), half));
+    }
+
+    s16_to_float_scalar(in + i * 2, left + i, right + i, mono + i, scale, n - i);
+}
+
+__attribute__((target("sse2")))
+static void float_to_s16_sse2(const float* left, const float* right, Sint16* out, float scale, int n) {
+    __m128 s = _mm_set1_ps(scale), hi = _mm_set1_ps(32767.0f), lo = _mm_set1_ps(-32768.0f);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i l = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(left + i), s), hi), lo));
+        __m128i r = _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_loadu_ps(right + i), s), hi), lo));
+        _mm_storeu_si128((__m128i*)(out + i * 2), _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r)));
+    }
+
+    float_to_s16_scalar(left + i, right + i, out + i * 2, scale, n - i);
+}
+
+__attribute__((target("sse2")))
+static void mix_add_sse2(float* dst, const float* src, float gain, int n) {
+    __m128 g = _mm_set1_ps(gain);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) { _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g))); }
+
+    mix_add_scalar(dst + i, src + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+static void mix_mul_add_sse2(float* dst, const float* a, const float* b, float gain, int n) {
+    __m128 g = _mm_set1_ps(gain);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), g);
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), v));
+    }
+
+    mix_mul_add_scalar(dst + i, a + i, b + i, gain, n - i);
+}
+
+__attribute__((target("sse2")))
+static void mul_sse2(float* dst, const float* src, int n) {
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) { _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i))); }
+
+    mul_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void s16_to_float_avx2(const Sint16* in, float* left, float* right, float* mono, float scale, int n) {
+    __m256 s = _mm256_set1_ps(scale), half = _mm256_set1_ps(0.5f);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(in + i * 2));
+        __m256 l = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16)), s);
+        __m256 r = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(x, 16)), s);
+        _mm256_storeu_ps(left + i, l);
+        _mm256_storeu_ps(right + i, r);
+        _mm256_storeu_ps(mono + i, _mm256_mul_ps(_mm256_add_ps(l, r), half));
+    }
+
+    s16_to_float_sse2(in + i * 2, left + i, right + i, mono + i, scale, n - i);
+}
+
+__attribute__((target("avx2")))
+static void float_to_s16_avx2(const float* left, const float* right, Sint16* out, float scale, int n) {
+    __m256 s = _mm256_set1_ps(scale), hi = _mm256_set1_ps(32767.0f), lo = _mm256_set1_ps(-32768.0f);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256i l = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(left + i), s), hi), lo));
+        __m256i r = _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(right + i), s), hi), lo));
+        // unpack/packs работают внутри 128-битных половин, поэтому порядок кадров сохраняется
+        _mm256_storeu_si256((__m256i*)(out + i * 2), _mm256_packs_epi32(_mm256_unpacklo_epi32(l, r), _mm256_unpackhi_epi32(l, r)));
+    }
+
+    float_to_s16_sse2(left + i, right + i, out + i * 2, scale, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mix_add_avx2(float* dst, const float* src, float gain, int n) {
+    __m256 g = _mm256_set1_ps(gain);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), g))); }
+
+    mix_add_sse2(dst + i, src + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mix_mul_add_avx2(float* dst, const float* a, const float* b, float gain, int n) {
+    __m256 g = _mm256_set1_ps(gain);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), g);
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), v));
+    }
+
+    mix_mul_add_sse2(dst + i, a + i, b + i, gain, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_avx2(float* dst, const float* src, int n) {
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) { _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(dst + i), _mm256_loadu_ps(src + i))); }
+
+    mul_sse2(dst + i, src + i, n - i);
+}
+
+static const DspKernels dsp_sse2 = {
+    "sse2", s16_to_float_sse2, float_to_s16_sse2, mix_add_sse2, mix_mul_add_sse2, mul_sse2
+};
+
+static const DspKernels dsp_avx2 = {
+    "avx2", s16_to_float_avx2, float_to_s16_avx2, mix_add_avx2, mix_mul_add_avx2, mul_avx2
+};
+#endif
+
+static const DspKernels* dsp = &dsp_scalar;
+
+// Выбор ядер по возможностям CPU; allow_simd = 0 оставляет скалярный эталон
+void dsp_init(int allow_simd) {
+    dsp = &dsp_scalar;
+#ifdef DSP_X86
+
+    if (allow_simd && SDL_HasAVX2()) { dsp = &dsp_avx2; }
+
+    else if (allow_simd && SDL_HasSSE2()) { dsp = &dsp_sse2; }
+
+#endif
+}
+
+static void delay_line_write(DelayLine* line, const float* in, int n) {
+    int first = line->mask + 1 - line->pos < n ? line->mask + 1 - line->pos : n;
+    memcpy(line->data + line->pos, in, first * sizeof(float));
+    memcpy(line->data, in + first, (n - first) * sizeof(float));
+    line->pos = (line->pos + n) & line->mask;
+}
+
+// n отсчётов начиная с отстоящего на distance назад от позиции записи (не более двух memcpy)
+static void delay_line_read(const DelayLine* line, int distance, float* tap, int n) {
+    int start = (line->pos - distance) & line->mask;
+    int first = line->mask + 1 - start < n ? line->mask + 1 - start : n;
+    memcpy(tap, line->data + start, first * sizeof(float));
+    memcpy(tap + first, line->data, (n - first) * sizeof(float));
+}
+
+/*
+    LFO для хоруса, вибрато и тремоло без sinf на аудиопотоке. Точка (sin, cos) поворачивается
+    рекуррентно раз в LFO_CONTROL_PERIOD отсчётов, между контрольными точками значение линейно
+    интерполируется. Ошибка интерполяции синуса не больше (w * P)^2 / 8, где w = 2*pi*f/fs, P — период:
+    для 3 Гц при 44100 Гц это ~2.3e-5, для 20 Гц ~1.1e-3. Поворот считается в double (раз в P отсчётов
+    это бесплатно), амплитуда поправляется на каждом шаге, поэтому фаза и амплитуда не дрейфуют.
+    sin/cos вызываются только при смене частоты.
+*/
+
+#define LFO_CONTROL_PERIOD 32
+#define VIBRATO_RATE 3.0f
+#define TREMOLO_RATE 3.0f
+
+typedef struct {
+    double sin, cos;         // значение в следующей контрольной точке
+    double rot_sin, rot_cos; // поворот за LFO_CONTROL_PERIOD отсчётов
+    float value, slope;     // текущее значение и приращение за отсчёт
+    int remaining;          // отсчётов до контрольной точки
+    float freq;
+} Lfo;
+
+static void lfo_set_freq(Lfo* lfo, float freq, int sample_rate) {
+    double step = 2.0 * M_PI * freq * LFO_CONTROL_PERIOD / sample_rate;
+    lfo->rot_sin = sin(step);
+    lfo->rot_cos = cos(step);
+    lfo->freq = freq;
+}
+
+static void lfo_init(Lfo* lfo, float phase, float freq, int sample_rate) {
+    lfo->sin = sin(phase);
+    lfo->cos = cos(phase);
+    lfo->value = lfo->slope = 0.0f;
+    lfo->remaining = 0;
+    lfo_set_freq(lfo, freq, sample_rate);
+}
+
+static float lfo_error_bound(float freq, int sample_rate) {
+    float w = 2.0f * (float)M_PI * freq * LFO_CONTROL_PERIOD / sample_rate;
+    return w * w / 8.0f + 1e-5f; // + запас на округление float
+}
+
+static void lfo_render(Lfo* lfo, float* out, int n) {
+    for (int i = 0; i < n;) {
+        if (lfo->remaining == 0) {
+            double s = lfo->sin * lfo->rot_cos + lfo->cos * lfo->rot_sin;
+            double c = lfo->cos * lfo->rot_cos - lfo->sin * lfo->rot_sin;
+            double norm = 1.5 - 0.5 * (s * s + c * c); // 1/sqrt(s^2 + c^2) в первом приближении
+            lfo->value = (float)lfo->sin;
+            lfo->slope = (float)((s * norm - lfo->sin) / LFO_CONTROL_PERIOD);
+            lfo->sin = s * norm;
+            lfo->cos = c * norm;
+            lfo->remaining = LFO_CONTROL_PERIOD;
+        }
+
+        int count = lfo->remaining < n - i ? lfo->remaining : n - i;
+
+        for (int k = 0; k < count; k++) { out[i + k] = lfo->value + lfo->slope * k; }
+
+        lfo->value += lfo->slope * count;
+        lfo->remaining -= count;
+        i += count;
+    }
+}
+
+#define LIMITER_LOOKAHEAD 64 // степень двойки, ~1.5 мс при 44100 Гц
+#define LIMITER_RELEASE_MS 50.0f
+
+typedef struct {
+    float delay_left[LIMITER_LOOKAHEAD], delay_right[LIMITER_LOOKAHEAD];
+    float hold_value[LIMITER_LOOKAHEAD]; // монотонная очередь минимумов
+    Uint32 hold_time[LIMITER_LOOKAHEAD];
+    Uint32 hold_head, hold_tail;
+    float box[LIMITER_LOOKAHEAD];
+    double box_sum;
+    float release_gain;
+    Uint32 time;
+} Limiter;
+
+/*
+    Контекст цепочки эффектов — всё состояние одного потока: линии задержки, фазы LFO, лимитер,
+    собранная цепочка и рабочие блоки. Глобально только таблица ядер dsp (после dsp_init не меняется),
+    поэтому независимые контексты можно обрабатывать параллельно из разных потоков.
+    Контекст вместе с обеими линиями задержки — одно выделение памяти в effect_chain_create().
+
+    Собранная цепочка: упорядоченный массив включённых стадий, пересобирается на границе блока, когда
+    приходит новый снимок параметров. Выключенные стадии в цепочку не попадают и ничего не стоят.
+    Стадия, которая включается или выключается, один блок работает с линейной рампой 0->1 или 1->0,
+    у лимитера в этом блоке плавно меняется только усиление — переключение без щелчков.
+*/
+
+typedef struct {
+    int sample_rate;
+    int echo_delay, reverb_delays[5], chorus_delays[3], stereo_delay; // в отсчётах при sample_rate
+    float release; // восстановление лимитера за кадр
+    DelayLine dry_history, reverb_history;
+    Lfo chorus_lfo[3], vibrato_lfo, tremolo_lfo;
+    Limiter limiter;
+
+    const EffectParams* params; // снимок для текущего блока
+    const EffectParams* source; // снимок, под который собрана цепочка
+    int active[STAGE_COUNT];    // состояние стадий после текущего блока
+    struct { StageId id; int fade; } stages[STAGE_COUNT];
+    int count;
+    int limiter_active, limiter_fade;
+    int transition; // в блоке есть рампы, после него пересобрать без них
+    int bypassed;   // работал только effect_chain_limit: линии задержки стоят с хвостом прошлого звука
+
+    float left[AUDIO_BLOCK_FRAMES], right[AUDIO_BLOCK_FRAMES], mono[AUDIO_BLOCK_FRAMES];
+    float wet[AUDIO_BLOCK_FRAMES], tap[AUDIO_BLOCK_FRAMES], mod[AUDIO_BLOCK_FRAMES];
+    float sum[AUDIO_BLOCK_FRAMES], fade[AUDIO_BLOCK_FRAMES];
+    float history[]; // dry_history, затем reverb_history
+} EffectChain;
+
+// Рампа для стадии, которая появляется (+1) или исчезает (-1) в этом блоке
+static const float* fade_ramp(EffectChain* c, int fade, int n) {
+    for (int i = 0; i < n; i++) { c->fade[i] = fade > 0 ? (i + 1.0f) / n : 1.0f - (i + 1.0f) / n; }
+
+    return c->fade;
+}
+
+// Добавить c->wet в оба канала, с рампой при переключении
+static void apply_wet(EffectChain* c, const float* fade, int n) {
+    if (fade) { dsp->mul(c->wet, fade, n); }
+
+    dsp->mix_add(c->left, c->wet, 1.0f, n);
+    dsp->mix_add(c->right, c->wet, 1.0f, n);
+}
+
+// Умножить оба канала на огибающую c->mod; при переключении огибающая плавно уходит в 1
+static void apply_gain(EffectChain* c, const float* fade, int n) {
+    if (fade) {
+        for (int i = 0; i < n; i++) { c->mod[i] = 1.0f + (c->mod[i] - 1.0f) * fade[i]; }
+    }
+
+    dsp->mul(c->left, c->mod, n);
+    dsp->mul(c->right, c->mod, n);
+}
+
+// Стадии по общей истории вызываются после записи блока: отсчёт i блока задержан на delay, если читать с n + delay назад
+static void echo_stage(EffectChain* c, const float* fade, int n) {
+    delay_line_read(&c->dry_history, n + c->echo_delay, c->tap, n);
+    memset(c->wet, 0, n * sizeof(float));
+    dsp->mix_add(c->wet, c->tap, 0.3f, n);
+    apply_wet(c, fade, n);
+}
+
+// Обратная связь: вход линии зависит от её же выхода, поэтому шаг не больше самой короткой задержки
+static void reverb_stage(EffectChain* c, const float* fade, int n) {
+    const int* delays = c->reverb_delays;
+    const int step = delays[3];
+    float damping = 1.0f - c->params->reverb_damping;
+    float gains[5] = { 0.5f, 0.4f, 0.3f, 0.3f * damping, 0.15f * damping };
+    memset(c->wet, 0, n * sizeof(float));
+
+    for (int offset = 0; offset < n; offset += step) {
+        int count = n - offset < step ? n - offset : step;
+        memset(c->sum, 0, count * sizeof(float));
+
+        for (int k = 0; k < 5; k++) {
+            delay_line_read(&c->reverb_history, delays[k], c->tap, count);
+            dsp->mix_add(c->sum, c->tap, gains[k], count);
+        }
+
+        dsp->mix_add(c->wet + offset, c->sum, 0.2f, count);
+        memcpy(c->tap, c->mono + offset, count * sizeof(float));
+        dsp->mix_add(c->tap, c->sum, c->params->reverb_feedback, count);
+        delay_line_write(&c->reverb_history, c->tap, count);
+    }
+
+    apply_wet(c, fade, n);
+}
+
+// Пока реверберация была выключена, её линия не писалась: начинаем с тишины, а не со старого хвоста
+static void reverb_activate(EffectChain* c) {
+    memset(c->reverb_history.data, 0, (c->reverb_history.mask + 1) * sizeof(float));
+}
+
+// mod = 0.5 + depth * lfo, поэтому tap * mod * gain раскладывается на две операции ядра
+static void chorus_stage(EffectChain* c, const float* fade, int n) {
+    const int* delays = c->chorus_delays;
+    float gains[3] = { 0.4f * 0.15f, 0.4f * 0.15f, 0.3f * 0.15f };
+    memset(c->wet, 0, n * sizeof(float));
+
+    for (int k = 0; k < 3; k++) {
+        if (c->chorus_lfo[k].freq != c->params->chorus_speed) { lfo_set_freq(&c->chorus_lfo[k], c->params->chorus_speed, c->sample_rate); }
+
+        lfo_render(&c->chorus_lfo[k], c->mod, n);
+        delay_line_read(&c->dry_history, n + delays[k], c->tap, n);
+        dsp->mix_add(c->wet, c->tap, 0.5f * gains[k], n);
+        dsp->mix_mul_add(c->wet, c->tap, c->mod, c->params->chorus_depth * gains[k], n);
+    }
+
+    apply_wet(c, fade, n);
+}
+
+static void vibrato_stage(EffectChain* c, const float* fade, int n) {
+    lfo_render(&c->vibrato_lfo, c->mod, n);
+
+    for (int i = 0; i < n; i++) { c->mod[i] = 1.0f + c->mod[i] * 0.03f; }
+
+    apply_gain(c, fade, n);
+}
+
+static void tremolo_stage(EffectChain* c, const float* fade, int n) {
+    lfo_render(&c->tremolo_lfo, c->mod, n);
+
+    for (int i = 0; i < n; i++) { c->mod[i] = 0.85f + 0.075f * c->mod[i]; }
+
+    apply_gain(c, fade, n);
+}
+
+static void stereo_stage(EffectChain* c, const float* fade, int n) {
+    delay_line_read(&c->dry_history, n + c->stereo_delay, c->tap, n);
+
+    if (fade) { dsp->mul(c->tap, fade, n); }
+
+    dsp->mix_add(c->left, c->tap, 0.5f, n);
+    dsp->mix_add(c->right, c->tap, -0.5f, n);
+}
+
+static const struct {
+    void (*process)(EffectChain* c, const float* fade, int n);
+    void (*activate)(EffectChain* c); // сброс состояния при включении, может быть NULL
+} stage_table[STAGE_COUNT] = {
+    [STAGE_ECHO] = { echo_stage, NULL },
+    [STAGE_REVERB] = { reverb_stage, reverb_activate },
+    [STAGE_CHORUS] = { chorus_stage, NULL },
+    [STAGE_VIBRATO] = { vibrato_stage, NULL },
+    [STAGE_TREMOLO] = { tremolo_stage, NULL },
+    [STAGE_STEREO] = { stereo_stage, NULL },
+};
+
+/*
+    Потоковый лимитер с заглядыванием вперёд (вместо пересчёта громкости всего блока по пику).
+    Для каждого кадра нужное усиление r = threshold / peak (или 1), затем:
+      - минимум r за последние LIMITER_LOOKAHEAD кадров (монотонная очередь, O(1) в среднем);
+      - мгновенная атака, экспоненциальное восстановление за LIMITER_RELEASE_MS;
+      - скользящее среднее за те же LIMITER_LOOKAHEAD кадров — плавный спуск к нужному усилению.
+    Звук задержан на LIMITER_LOOKAHEAD - 1 кадров, поэтому к приходу пика усиление уже не больше r:
+    все значения в окне среднего покрывают этот кадр. Выход сразу пишется в Sint16 с насыщением.
+    Задержка есть всегда, и при выключенном лимитере: engage (0..1, рампа при переключении) смешивает
+    только усиление с 1, так что переключение меняет громкость, но не сдвигает звук во времени.
+*/
+
+static void limiter_reset(Limiter* lim) {
+    memset(lim, 0, sizeof(*lim));
+
+    for (int i = 0; i < LIMITER_LOOKAHEAD; i++) { lim->box[i] = 1.0f; }
+
+    lim->box_sum = LIMITER_LOOKAHEAD;
+    lim->release_gain = 1.0f;
+}
+
+static void limiter_process(Limiter* lim, float threshold, float release, const float* left, const float* right, float* peaks,
+                            const float* ramp, float engage, Sint16* out, int n) {
+    const Uint32 mask = LIMITER_LOOKAHEAD - 1;
+
+    // Пики без ветвлений, векторизуется; дальше последовательная часть
+    for (int i = 0; i < n; i++) { peaks[i] = fmaxf(fabsf(left[i]), fabsf(right[i])); }
+
+    for (int i = 0; i < n; i++) {
+        Uint32 t = lim->time++;
+        Uint32 pos = t & mask;
+        float required = peaks[i] > threshold ? threshold / peaks[i] : 1.0f;
+
+        while (lim->hold_tail != lim->hold_head && lim->hold_value[(lim->hold_tail - 1) & mask] >= required) { lim->hold_tail--; }
+
+        lim->hold_value[lim->hold_tail & mask] = required;
+        lim->hold_time[lim->hold_tail & mask] = t;
+        lim->hold_tail++;
+
+        while (t - lim->hold_time[lim->hold_head & mask] >= LIMITER_LOOKAHEAD) { lim->hold_head++; }
+
+        float hold = lim->hold_value[lim->hold_head & mask];
+        lim->release_gain = hold < lim->release_gain ? hold : lim->release_gain + (hold - lim->release_gain) * release;
+        lim->box_sum += lim->release_gain - lim->box[pos];
+        lim->box[pos] = lim->release_gain;
+        float limit = (float)(lim->box_sum * (1.0 / LIMITER_LOOKAHEAD));
+        float gain = (1.0f + (limit - 1.0f) * (ramp ? ramp[i] : engage)) * 32767.0f;
+
+        lim->delay_left[pos] = left[i];
+        lim->delay_right[pos] = right[i];
+        float l = lim->delay_left[(t + 1) & mask] * gain;
+        float r = lim->delay_right[(t + 1) & mask] * gain;
+        out[i * 2] = (Sint16)(l > 32767.0f ? 32767.0f : (l < -32768.0f ? -32768.0f : l));
+        out[i * 2 + 1] = (Sint16)(r > 32767.0f ? 32767.0f : (r < -32768.0f ? -32768.0f : r));
+    }
+}
+
+static int scale_delay(int samples, int sample_rate) {
+    return (int)(((long long)samples * sample_rate + SAMPLE_RATE / 2) / SAMPLE_RATE);
+}
+
+static int next_pow2(int n) {
+    int size = 1;
+
+    while (size < n) { size <<= 1; }
+
+    return size;
+}
+
+// Задержки масштабируются под sample_rate, линии — степени двойки; NULL при неподдерживаемой частоте
+EffectChain* effect_chain_create(int sample_rate) {
+    if (sample_rate < 8000 || sample_rate > MAX_SAMPLE_RATE) {
+        fprintf(stderr, "Unsupported sample rate: %d Hz (8000..%d)\n", sample_rate, MAX_SAMPLE_RATE);
+        return NULL;
+    }
+
+    int reverb[5] = { REVERB_DELAY_1, REVERB_DELAY_2, REVERB_DELAY_3, REVERB_DELAY_4, REVERB_DELAY_5 };
+    int chorus[3] = { CHORUS_DELAY_1, CHORUS_DELAY_2, CHORUS_DELAY_3 };
+    int echo_delay = scale_delay(ECHO_DELAY, sample_rate);
+    int reverb_max = 0;
+
+    for (int k = 0; k < 5; k++) {
+        reverb[k] = scale_delay(reverb[k], sample_rate);
+        reverb_max = reverb[k] > reverb_max ? reverb[k] : reverb_max;
+    }
+
+    int dry_size = next_pow2(echo_delay + AUDIO_BLOCK_FRAMES);
+    int reverb_size = next_pow2(reverb_max);
+    EffectChain* c = calloc(1, sizeof(EffectChain) + (size_t)(dry_size + reverb_size) * sizeof(float));
+
+    if (!c) { return NULL; }
+
+    c->sample_rate = sample_rate;
+    c->echo_delay = echo_delay;
+    c->stereo_delay = scale_delay(STEREO_DELAY, sample_rate);
+    memcpy(c->reverb_delays, reverb, sizeof(reverb));
+
+    for (int k = 0; k < 3; k++) { c->chorus_delays[k] = scale_delay(chorus[k], sample_rate); }
+
+    c->release = 1.0f - expf(-1000.0f / (LIMITER_RELEASE_MS * sample_rate));
+    c->dry_history = (DelayLine){ c->history, dry_size - 1, 0 };
+    c->reverb_history = (DelayLine){ c->history + dry_size, reverb_size - 1, 0 };
+    return c;
+}
+
+void effect_chain_destroy(EffectChain* c) {
+    free(c);
+}
+
+// Тишина в линиях, фазы LFO с начала, цепочка сразу в состоянии p без рамп (старт и сброс)
+void effect_chain_reset(EffectChain* c, const EffectParams* p) {
+    memset(c->history, 0, (size_t)(c->dry_history.mask + 1 + c->reverb_history.mask + 1) * sizeof(float));
+    c->dry_history.pos = c->reverb_history.pos = 0;
+    limiter_reset(&c->limiter);
+    lfo_init(&c->chorus_lfo[0], 0.5f, p->chorus_speed, c->sample_rate);
+    lfo_init(&c->chorus_lfo[1], 0.5f, p->chorus_speed, c->sample_rate);
+    lfo_init(&c->chorus_lfo[2], 0.0f, p->chorus_speed, c->sample_rate);
+    lfo_init(&c->vibrato_lfo, 0.0f, VIBRATO_RATE, c->sample_rate);
+    lfo_init(&c->tremolo_lfo, 0.0f, TREMOLO_RATE, c->sample_rate);
+
+    for (int id = 0; id < STAGE_COUNT; id++) { c->active[id] = stage_enabled(p, id); }
+
+    c->limiter_active = p->limiter_enabled;
+    c->source = NULL;
+    c->bypassed = 0;
+}
+
+static void effect_chain_compile(EffectChain* c, const EffectParams* p) {
+    c->count = 0;
+    c->transition = 0;
+
+    for (int k = 0; k < STAGE_COUNT; k++) {
+        StageId id = p->order[k];
+        int enabled = stage_enabled(p, id);
+        int fade = enabled - c->active[id];
+
+        if (!enabled && !c->active[id]) { continue; }
+
+        if (fade > 0 && stage_table[id].activate) { stage_table[id].activate(c); }
+
+        c->stages[c->count].id = id;
+        c->stages[c->count].fade = fade;
+        c->count++;
+        c->active[id] = enabled;
+        c->transition |= fade != 0;
+    }
+
+    c->limiter_fade = p->limiter_enabled - c->limiter_active;
+    c->limiter_active = p->limiter_enabled;
+    c->transition |= c->limiter_fade != 0;
+    c->source = p;
+}
+
+// Обработка на месте: pcm — чередующиеся L/R Sint16, frames кадров, p — снимок параметров
+void effect_chain_process(EffectChain* c, const EffectParams* p, Sint16* pcm, int frames) {
+    // Пока шёл звук мимо цепочки, линии задержки стояли с хвостом давно ушедшего трека
+    if (c->bypassed) { effect_chain_reset(c, p); }
+
+    c->params = p;
+
+    for (int offset = 0; offset < frames; offset += AUDIO_BLOCK_FRAMES) {
+        int n = frames - offset < AUDIO_BLOCK_FRAMES ? frames - offset : AUDIO_BLOCK_FRAMES;
+        Sint16* out = pcm + offset * 2;
+
+        if (p != c->source || c->transition) { effect_chain_compile(c, p); }
+
+        // Единственное преобразование на входе: Sint16 -> float с громкостью
+        dsp->s16_to_float(out, c->left, c->right, c->mono, p->global_volume / 32768.0f, n);
+        delay_line_write(&c->dry_history, c->mono, n);
+
+        for (int k = 0; k < c->count; k++) {
+            int fade = c->stages[k].fade;
+            stage_table[c->stages[k].id].process(c, fade ? fade_ramp(c, fade, n) : NULL, n);
+        }
+
+        // Единственное преобразование на выходе: лимитер (выключенный — только задержка и насыщение) сразу в Sint16
+        limiter_process(&c->limiter, p->limiter_threshold, c->release, c->left, c->right, c->sum,
+                        c->limiter_fade ? fade_ramp(c, c->limiter_fade, n) : NULL, (float)c->limiter_active, out, n);
+    }
+}
+
+// Только выходная стадия: громкость p->global_volume * gain и лимитер, линии задержки и LFO стоят.
+// Стадии до лимитера линейны, поэтому для звука из кэша это то же, что полная цепочка вживую
+void effect_chain_limit(EffectChain* c, const EffectParams* p, float gain, Sint16* pcm, int frames) {
+    c->bypassed = 1;
+
+    for (int offset = 0; offset < frames; offset += AUDIO_BLOCK_FRAMES) {
+        int n = frames - offset < AUDIO_BLOCK_FRAMES ? frames - offset : AUDIO_BLOCK_FRAMES;
+        int fade = p->limiter_enabled - c->limiter_active;
+        Sint16* out = pcm + offset * 2;
+        c->limiter_active = p->limiter_enabled;
+        dsp->s16_to_float(out, c->left, c->right, c->mono, p->global_volume * gain / 32768.0f, n);
+        limiter_process(&c->limiter, p->limiter_threshold, c->release, c->left, c->right, c->sum,
+                        fade ? fade_ramp(c, fade, n) : NULL, (float)c->limiter_active, out, n);
+    }
+}
+
+/*
+    Тайминг колбэка: время audio_effect() в долях периода буфера (frames / sample_rate) и интервал между
+    колбэками. Пишет только аудиопоток, счётчики атомарные, главный поток читает их без блокировок.
+    Цена — два SDL_GetPerformanceCounter и пара атомарных инкрементов на колбэк, остаётся включённым всегда.
+    Post-mix вызывается после синтезатора, поэтому перегрузку самого синтезатора видно по опоздавшим колбэкам.
+*/
+
+#define TIMING_BUCKETS 12
+#define TIMING_NEAR_MISS 0.75 // доля периода, начиная с которой колбэк считается почти опоздавшим
+#define TIMING_LATE_GAP 2.0   // интервал между колбэками больше стольких периодов — вероятный провал
+
+static const double timing_limits[TIMING_BUCKETS - 1] = { 0.001, 0.0025, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 0.75, 0.9, 1.0 };
+
+static struct {
+    SDL_atomic_t buckets[TIMING_BUCKETS];
+    SDL_atomic_t near_miss, missed, late;
+    SDL_atomic_t worst; // худший колбэк, в десятитысячных периода
+    SDL_atomic_t buffer_frames; // кадров в первом колбэке: буфер, который на самом деле дало устройство (0 — не было)
+    Uint64 last_start;  // только аудиопоток
+    double ticks_per_frame;
+} callback_timing;
+
+static void callback_timing_reset() {
+    for (int i = 0; i < TIMING_BUCKETS; i++) { SDL_AtomicSet(&callback_timing.buckets[i], 0); }
+
+    SDL_AtomicSet(&callback_timing.near_miss, 0);
+    SDL_AtomicSet(&callback_timing.missed, 0);
+    SDL_AtomicSet(&callback_timing.late, 0);
+    SDL_AtomicSet(&callback_timing.worst, 0);
+    SDL_AtomicSet(&callback_timing.buffer_frames, 0);
+    callback_timing.last_start = 0;
+    callback_timing.ticks_per_frame = (double)SDL_GetPerformanceFrequency() / audio_format.sample_rate;
+}
+
+static void callback_timing_record(Uint64 start, int frames) {
+    double period = frames * callback_timing.ticks_per_frame;
+    double load = (double)(SDL_GetPerformanceCounter() - start) / period;
+    int bucket = 0;
+
+    while (bucket < TIMING_BUCKETS - 1 && load >= timing_limits[bucket]) { bucket++; }
+
+    SDL_AtomicIncRef(&callback_timing.buckets[bucket]);
+
+    if (load >= 1.0) { SDL_AtomicIncRef(&callback_timing.missed); }
+
+    else if (load >= TIMING_NEAR_MISS) { SDL_AtomicIncRef(&callback_timing.near_miss); }
+
+    // Писатель один, поэтому сравнить и записать можно без CAS
+    if ((int)(load * 10000.0) > SDL_AtomicGet(&callback_timing.worst)) { SDL_AtomicSet(&callback_timing.worst, (int)(load * 10000.0)); }
+
+    if (callback_timing.last_start && start - callback_timing.last_start > TIMING_LATE_GAP * period) { SDL_AtomicIncRef(&callback_timing.late); }
+
+    // SDL_mixer не сообщает размер буфера, а устройство может дать не тот, что просили
+    if (!callback_timing.last_start) { SDL_AtomicSet(&callback_timing.buffer_frames, frames); }
+
+    callback_timing.last_start = start;
+}
+
+void callback_timing_report() {
+    int counts[TIMING_BUCKETS], total = 0, peak = 1;
+
+    for (int i = 0; i < TIMING_BUCKETS; i++) {
+        counts[i] = SDL_AtomicGet(&callback_timing.buckets[i]);
+        total += counts[i];
+        peak = counts[i] > peak ? counts[i] : peak;
+    }
+
+    if (total == 0) {
+        printf("Audio callback timing: no callbacks recorded\n");
+        return;
+    }
+
+    int buffer_frames = SDL_AtomicGet(&callback_timing.buffer_frames);
+    printf("Audio callback timing: %d callbacks, buffer %d frames (%.1f ms), effects time / buffer period:\n",
+           total, buffer_frames, buffer_frames * 1000.0 / audio_format.sample_rate);
+
+    for (int i = 0; i < TIMING_BUCKETS; i++) {
+        char label[16];
+
+        if (i < TIMING_BUCKETS - 1) { snprintf(label, sizeof(label), "< %g%%", timing_limits[i] * 100.0); }
+
+        else { snprintf(label, sizeof(label), ">= %g%%", timing_limits[i - 1] * 100.0); }
+
+        int bar = (int)(40.0 * counts[i] / peak + 0.5);
+        printf("  %-8s %8d %.*s\n", label, counts[i], bar, "########################################");
+    }
+
+    printf("  near miss (>= %g%%): %d, missed (>= 100%%): %d, late callbacks (gap > %g periods): %d, worst %.2f%%\n",
+           TIMING_NEAR_MISS * 100.0, SDL_AtomicGet(&callback_timing.near_miss), SDL_AtomicGet(&callback_timing.missed),
+           TIMING_LATE_GAP, SDL_AtomicGet(&callback_timing.late), SDL_AtomicGet(&callback_timing.worst) / 100.0);
+}
+
+/*
+    Уровни звука для графики: на выходе колбэка моно делится однополюсными фильтрами на три полосы
+    (< 200 Гц, 200 Гц..2 кГц, > 2 кГц), RMS каждой полосы за колбэк кладётся в SPSC-кольцо.
+    Аудиопоток только пишет (если кольцо полно — уровень теряется, ждать нельзя), цикл рендера раз в кадр
+    забирает всё накопленное. Индексы — счётчики в SDL_atomic_t, каждый пишет только свой; без блокировок
+    и выделений памяти, цена — несколько операций на отсчёт (единицы микросекунд на колбэк).
+*/
+
+#define METER_RING_SIZE 64 // степень двойки
+#define METER_LOW_HZ 200.0f
+#define METER_HIGH_HZ 2000.0f
+
+typedef struct { float low, mid, high; } BandLevels;
+
+static struct {
+    BandLevels slots[METER_RING_SIZE];
+    SDL_atomic_t written, read;
+    float low_coeff, high_coeff; // коэффициенты однополюсных ФНЧ
+    float low_state, high_state; // только аудиопоток
+} audio_meter;
+
+static void audio_meter_reset() {
+    audio_meter.low_coeff = 1.0f - expf(-2.0f * (float)M_PI * METER_LOW_HZ / audio_format.sample_rate);
+    audio_meter.high_coeff = 1.0f - expf(-2.0f * (float)M_PI * METER_HIGH_HZ / audio_format.sample_rate);
+    audio_meter.low_state = audio_meter.high_state = 0.0f;
+    SDL_AtomicSet(&audio_meter.written, 0);
+    SDL_AtomicSet(&audio_meter.read, 0);
+}
+
+// Аудиопоток: уровни полос готового звука
+static void audio_meter_write(const Sint16* pcm, int frames) {
+    float low = audio_meter.low_state, lowpass = audio_meter.high_state;
+    float low_sum = 0.0f, mid_sum = 0.0f, high_sum = 0.0f;
+
+    for (int i = 0; i < frames; i++) {
+        float mono = (pcm[i * 2] + pcm[i * 2 + 1]) * (0.5f / 32768.0f);
+        low += (mono - low) * audio_meter.low_coeff;
+        lowpass += (mono - lowpass) * audio_meter.high_coeff;
+        low_sum += low * low;
+        mid_sum += (lowpass - low) * (lowpass - low);
+        high_sum += (mono - lowpass) * (mono - lowpass);
+    }
+
+    audio_meter.low_state = low;
+    audio_meter.high_state = lowpass;
+    int written = SDL_AtomicGet(&audio_meter.written);
+
+    if (frames > 0 && written - SDL_AtomicGet(&audio_meter.read) < METER_RING_SIZE) {
+        BandLevels* slot = &audio_meter.slots[written & (METER_RING_SIZE - 1)];
+        slot->low = sqrtf(low_sum / frames);
+        slot->mid = sqrtf(mid_sum / frames);
+        slot->high = sqrtf(high_sum / frames);
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&audio_meter.written, written + 1);
+    }
+}
+
+// Главный поток: максимум по полосам за всё, что пришло с прошлого вызова; 0 если ничего не было
+int audio_meter_read(BandLevels* levels) {
+    int written = SDL_AtomicGet(&audio_meter.written);
+    int read = SDL_AtomicGet(&audio_meter.read);
+    SDL_MemoryBarrierAcquire();
+    *levels = (BandLevels){ 0.0f, 0.0f, 0.0f };
+
+    for (int i = read; i != written; i++) {
+        const BandLevels* slot = &audio_meter.slots[i & (METER_RING_SIZE - 1)];
+        levels->low = fmaxf(levels->low, slot->low);
+        levels->mid = fmaxf(levels->mid, slot->mid);
+        levels->high = fmaxf(levels->high, slot->high);
+    }
+
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&audio_meter.read, written);
+    return written != read;
+}
+
+/*
+    battery в шейдере двигает солнце, скорость сетки и свечение; без звука остаётся 1.0, как было.
+    Уровень нормируется по медленно спадающему пику (АРУ), поэтому тихие и громкие треки качают одинаково,
+    атака быстрая, спад медленный — солнце не дёргается от каждого удара.
+*/
+
+#define BATTERY_MIN 0.85f
+#define BATTERY_ATTACK 0.05f  // сек
+#define BATTERY_RELEASE 0.4f  // сек
+#define BATTERY_PEAK_DECAY 3.0f // сек
+#define BATTERY_IDLE 0.5f     // сек без уровней — возврат к 1.0
+
+typedef struct {
+    float value;
+    float peak;
+    float idle;
+} AudioReactive;
+
+float audio_reactive_update(AudioReactive* ar, float delta_time) {
+    BandLevels levels;
+    float target = 1.0f;
+
+    if (audio_meter_read(&levels)) {
+        float energy = levels.low + 0.7f * levels.mid + 0.3f * levels.high;
+        ar->peak = fmaxf(energy, ar->peak * expf(-delta_time / BATTERY_PEAK_DECAY));
+        target = BATTERY_MIN + (1.0f - BATTERY_MIN) * (ar->peak > 1e-4f ? energy / ar->peak : 0.0f);
+        ar->idle = 0.0f;
+    }
+
+    else if ((ar->idle += delta_time) < BATTERY_IDLE) { target = ar->value; }
+
+    float time_constant = target > ar->value ? BATTERY_ATTACK : BATTERY_RELEASE;
+    ar->value += (target - ar->value) * (1.0f - expf(-delta_time / time_constant));
+    return ar->value;
+}
+
+// Post-mix колбэк SDL_mixer: udata — EffectChain устройства, параметры из тройного буфера
+void audio_effect(void* udata, Uint8* stream, int len) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    int frames = len / (2 * sizeof(Sint16));
+    const EffectParams* params = effect_params_acquire();
+
+    if (params->chain_bypass) { effect_chain_limit((EffectChain*)udata, params, TRACK_CACHE_HEADROOM, (Sint16*)stream, frames); }
+
+    else { effect_chain_process((EffectChain*)udata, params, (Sint16*)stream, frames); }
+
+    audio_meter_write((const Sint16*)stream, frames);
+    callback_timing_record(start, frames);
+}
+
+/*
+    Офлайн-бенчмарк цепочки эффектов (без звуковой карты и MIDI):
+
+    ./wavepixel --bench input.wav [output.wav|output.raw]
+
+    Вход: WAV (PCM S16, стерео) или raw S16 стерео на частоте --rate (по умолчанию 44100 Гц). Данные прогоняются через audio_effect()
+    буферами по audio_format.buffer_frames кадров, как в post-mix колбэке SDL_mixer, на частоте входного файла.
+*/
+
+typedef struct {
+    Sint16* samples; // чередующиеся L/R
+    int frames;
+    int sample_rate;
+} PcmBuffer;
+
+static Uint32 read_le32(const Uint8* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((Uint32)p[3] << 24); }
+static Uint16 read_le16(const Uint8* p) { return p[0] | (p[1] << 8); }
+
+static void write_le32(Uint8* p, Uint32 v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static void write_le16(Uint8* p, Uint16 v) { p[0] = v; p[1] = v >> 8; }
+
+static int has_suffix(const char* name, const char* suffix) {
+    size_t len = strlen(name), slen = strlen(suffix);
+    return len >= slen && strcasecmp(name + len - slen, suffix) == 0;
+}
+
+// raw_rate — частота для raw-входа (у WAV она берётся из заголовка)
+int pcm_load(const char* path, PcmBuffer* pcm, int raw_rate) {
+    FILE* f = fopen(path, "rb");
+
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return 0;
+    }
+
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    Uint8* data = size >= 0 && fseek(f, 0, SEEK_SET) == 0 ? malloc(size > 0 ? size : 1) : NULL;
+
+    if (!data || fread(data, 1, size, f) != (size_t)size) {
+        fprintf(stderr, "Read error: %s\n", path);
+        free(data);
+        fclose(f);
+        return 0;
+    }
+
+    fclose(f);
+    const Uint8* pcm_data = data;
+    long pcm_size = size;
+    pcm->sample_rate = raw_rate;
+
+    if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WAVE", 4) == 0) {
+        long pos = 12;
+        int format_ok = 0;
+        pcm_data = NULL;
+
+        while (pos + 8 <= size) {
+            Uint32 chunk_size = read_le32(data + pos + 4);
+            const Uint8* chunk = data + pos + 8;
+            int fits = chunk_size <= (Uint32)(size - pos - 8);
+
+            // Недописанный data допустим (берём что есть), остальные блоки должны целиком помещаться в файл
+            if (memcmp(data + pos, "data", 4) == 0) {
+                pcm_data = chunk;
+                pcm_size = fits ? (long)chunk_size : size - pos - 8;
+                break;
+            }
+
+            if (!fits) { break; }
+
+            if (memcmp(data + pos, "fmt ", 4) == 0) {
+                if (chunk_size < 16) { break; }
+
+                format_ok = read_le16(chunk) == 1 && read_le16(chunk + 2) == 2 && read_le16(chunk + 14) == 16;
+                pcm->sample_rate = read_le32(chunk + 4);
+            }
+
+            pos += 8 + (long)chunk_size + (chunk_size & 1);
+        }
+
+        if (!format_ok || !pcm_data) {
+            fprintf(stderr, "%s: not a valid PCM S16 stereo WAV\n", path);
+            free(data);
+            return 0;
+        }
+    }
+
+    pcm->frames = pcm_size / (2 * sizeof(Sint16));
+    pcm->samples = malloc((size_t)pcm->frames * 2 * sizeof(Sint16) + 1);
+
+    if (!pcm->samples) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        free(data);
+        return 0;
+    }
+
+    memcpy(pcm->samples, pcm_data, (size_t)pcm->frames * 2 * sizeof(Sint16));
+    free(data);
+    return 1;
+}
+
+#define WAV_HEADER_SIZE 44
+
+// Заголовок PCM S16 стерео
+static void wav_header(Uint8* header, Uint32 frames, int sample_rate) {
+    Uint32 data_size = frames * 2 * sizeof(Sint16);
+    memcpy(header, "RIFF", 4);
+    write_le32(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    write_le32(header + 16, 16);
+    write_le16(header + 20, 1);
+    write_le16(header + 22, 2);
+    write_le32(header + 24, sample_rate);
+    write_le32(header + 28, sample_rate * 2 * sizeof(Sint16));
+    write_le16(header + 32, 2 * sizeof(Sint16));
+    write_le16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    write_le32(header + 40, data_size);
+}
+
+int pcm_save(const char* path, const PcmBuffer* pcm) {
+    FILE* f = fopen(path, "wb");
+
+    if (!f) {
+        fprintf(stderr, "Cannot create %s\n", path);
+        return 0;
+    }
+
+    Uint32 data_size = (Uint32)pcm->frames * 2 * sizeof(Sint16);
+
+    if (has_suffix(path, ".wav")) {
+        Uint8 header[WAV_HEADER_SIZE];
+        wav_header(header, pcm->frames, pcm->sample_rate);
+        fwrite(header, 1, sizeof(header), f);
+    }
+
+    int ok = fwrite(pcm->samples, 1, data_size, f) == data_size;
+    fclose(f);
+
+    if (!ok) { fprintf(stderr, "Write error: %s\n", path); }
+
+    return ok;
+}
+
+#define BENCH_RUNS 3
+
+// Лучшее время из BENCH_RUNS прогонов, результат последнего прогона остаётся в out
+static double bench_process(EffectChain* chain, const PcmBuffer* in, Sint16* out) {
+    double best = 0.0;
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        memcpy(out, in->samples, (size_t)in->frames * 2 * sizeof(Sint16));
+        effect_params_publish();
+        effect_chain_reset(chain, effect_params_acquire());
+        callback_timing_reset();
+        audio_meter_reset();
+        Uint64 start = SDL_GetPerformanceCounter();
+
+        for (int frame = 0; frame < in->frames; frame += audio_format.buffer_frames) {
+            int frames = in->frames - frame < audio_format.buffer_frames ? in->frames - frame : audio_format.buffer_frames;
+            audio_effect(chain, (Uint8*)(out + frame * 2), frames * 2 * sizeof(Sint16));
+        }
+
+        double elapsed = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+        if (run == 0 || elapsed < best) { best = elapsed; }
+    }
+
+    return best;
+}
+
+int run_bench(const char* input_path, const char* output_path, int buffer_frames, int raw_rate) {
+    PcmBuffer in, out;
+
+    if (!pcm_load(input_path, &in, raw_rate)) { return 1; }
+
+    if (in.frames == 0) {
+        fprintf(stderr, "%s: no audio data\n", input_path);
+        free(in.samples);
+        return 1;
+    }
+
+    out = in;
+    out.samples = malloc((size_t)in.frames * 2 * sizeof(Sint16));
+    double duration = (double)in.frames / in.sample_rate;
+
+    EffectChain* chain = effect_chain_create(in.sample_rate);
+
+    if (!chain) {
+        free(in.samples);
+        free(out.samples);
+        return 1;
+    }
+
+    audio_format.sample_rate = in.sample_rate;
+    audio_format.buffer_frames = buffer_frames;
+
+    dsp_init(1);
+    effect_params_init();
+    printf("Bench: %s, %d frames @ %d Hz (%.2f s), buffer %d frames, %s kernels\n",
+           input_path, in.frames, in.sample_rate, duration, buffer_frames, dsp->name);
+
+    int saved[EFFECT_SWITCH_COUNT];
+
+    for (int i = 0; i < EFFECT_SWITCH_COUNT; i++) {
+        saved[i] = *effect_switches[i].enabled;
+        *effect_switches[i].enabled = 0;
+    }
+
+    // Базовая стоимость (преобразования и громкость) и цена каждого эффекта по отдельности
+    double base = bench_process(chain, &in, out.samples);
+    printf("  %-8s %8.2f ns/frame\n", "base", base * 1e9 / in.frames);
+
+    for (int i = 0; i < EFFECT_SWITCH_COUNT; i++) {
+        *effect_switches[i].enabled = 1;
+        double t = bench_process(chain, &in, out.samples);
+        *effect_switches[i].enabled = 0;
+        printf("  %-8s %8.2f ns/frame\n", effect_switches[i].name, (t - base) * 1e9 / in.frames);
+    }
+
+    for (int i = 0; i < EFFECT_SWITCH_COUNT; i++) { *effect_switches[i].enabled = saved[i]; }
+
+    double total = bench_process(chain, &in, out.samples);
+    printf("  %-8s %8.2f ns/frame, %.2f Msamples/s, realtime x%.1f\n",
+           "chain", total * 1e9 / in.frames, in.frames * 2 / total / 1e6, duration / total);
+
+    // Запас по времени для каждого размера буфера: доля периода колбэка, которую занимает DSP
+    for (int frames = AUDIO_MIN_BUFFER_FRAMES; frames <= AUDIO_MAX_BUFFER_FRAMES; frames *= 2) {
+        audio_format.buffer_frames = frames;
+        double t = bench_process(chain, &in, out.samples);
+        double callbacks = (double)(in.frames + frames - 1) / frames;
+        double period_us = frames * 1e6 / in.sample_rate;
+        double callback_us = t * 1e6 / callbacks;
+        printf("  buffer %4d %6.2f ms period, %7.2f us/callback, %5.2f%% of period\n",
+               frames, period_us / 1000.0, callback_us, 100.0 * callback_us / period_us);
+    }
+
+    audio_format.buffer_frames = buffer_frames;
+    bench_process(chain, &in, out.samples);
+    callback_timing_report();
+
+    int ok = 1;
+
+    // Ошибка LFO относительно sinf на 60 с при частоте хоруса
+    static float lfo_block[AUDIO_BLOCK_FRAMES];
+    Lfo lfo;
+    lfo_init(&lfo, 0.0f, effect_params.chorus_speed, in.sample_rate);
+    double lfo_max_error = 0.0;
+
+    for (long frame = 0; frame < 60L * in.sample_rate; frame += AUDIO_BLOCK_FRAMES) {
+        lfo_render(&lfo, lfo_block, AUDIO_BLOCK_FRAMES);
+
+        for (int i = 0; i < AUDIO_BLOCK_FRAMES; i++) {
+            double error = fabs(lfo_block[i] - sin(2.0 * M_PI * effect_params.chorus_speed * (frame + i) / in.sample_rate));
+            lfo_max_error = error > lfo_max_error ? error : lfo_max_error;
+        }
+    }
+
+    float lfo_bound = lfo_error_bound(effect_params.chorus_speed, in.sample_rate);
+    int lfo_ok = lfo_max_error <= lfo_bound;
+    ok = ok && lfo_ok;
+    printf("  %-8s max error vs sin %.2e (bound %.2e) %s\n", "lfo", lfo_max_error, lfo_bound, lfo_ok ? "OK" : "FAILED");
+
+    // Сверка выбранных SIMD-ядер со скалярным эталоном
+    if (dsp != &dsp_scalar) {
+        const DspKernels* selected = dsp;
+        Sint16* reference = malloc((size_t)in.frames * 2 * sizeof(Sint16));
+        dsp = &dsp_scalar;
+        double scalar_time = bench_process(chain, &in, reference);
+        dsp = selected;
+        int max_diff = 0;
+
+        for (long i = 0; i < (long)in.frames * 2; i++) {
+            int diff = abs(out.samples[i] - reference[i]);
+            max_diff = diff > max_diff ? diff : max_diff;
+        }
+
+        ok = ok && max_diff <= DSP_TOLERANCE_LSB;
+        printf("  %-8s %8.2f ns/frame, %s vs scalar: max diff %d LSB (tolerance %d) %s\n",
+               "scalar", scalar_time * 1e9 / in.frames, dsp->name, max_diff, DSP_TOLERANCE_LSB, max_diff <= DSP_TOLERANCE_LSB ? "OK" : "FAILED");
+        free(reference);
+    }
+
+    if (output_path) {
+        ok = pcm_save(output_path, &out);
+
+        if (ok) { printf("Written: %s\n", output_path); }
+    }
+
+    effect_chain_destroy(chain);
+    free(in.samples);
+    free(out.samples);
+    return ok ? 0 : 1;
+}
+
+/*
+    Пакетная обработка файлов без звуковой карты:
+
+    ./wavepixel [--threads N] --batch OUT_DIR input1.wav input2.wav ...
+
+    По одному потоку и одному EffectChain на ядро, файлы раздаются через атомарный счётчик.
+    Каждый файл обрабатывается с начала (reset) текущими effect_params, результат — OUT_DIR/имя файла.
+    Тот же пул потоков и отчёт использует --bake; OUT_DIR создаётся, если его нет.
+*/
+
+#define BATCH_MAX_THREADS 64
+
+typedef struct {
+    char** inputs;
+    int count;
+    const char* output_dir;
+    const char* output_suffix; // NULL — имя как у входа, иначе расширение заменяется на это
+    const char* soundfont;     // --bake
+    int sample_rate;           // --bake; у --batch — частота raw-входа
+    int keep_tree;             // --bake: относительный путь входа повторяется внутри OUT_DIR
+    SDL_atomic_t next;
+    SDL_atomic_t failed;
+} BatchJob;
+
+typedef struct {
+    BatchJob* job;
+    double busy;  // секунды обработки, без чтения и записи файлов
+    double audio; // секунды обработанного звука
+    int files;
+} BatchWorker;
+
+// Каталог и все недостающие родительские; 0 если его так и нет (существующий — не ошибка)
+static int make_dirs(const char* path) {
+    char dir[4096];
+    struct stat st;
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    for (char* p = dir + 1; ; p++) {
+        char c = *p;
+
+        if (c != '/' && c != '\\' && c != '\0') { continue; }
+
+        *p = '\0';
+
+#ifdef _WIN32
+        CreateDirectoryA(dir, NULL);
+#else
+        mkdir(dir, 0755);
+#endif
+
+        *p = c;
+
+        if (c == '\0') { break; }
+    }
+
+    return stat(dir, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// OUT_DIR/имя входного файла (при keep_tree — весь относительный путь), с заменой расширения на output_suffix
+static void batch_output_path(const BatchJob* job, const char* input, char* path, size_t size) {
+    const char* name = strrchr(input, '/');
+
+#ifdef _WIN32
+    const char* name_win = strrchr(input, '\\');
+    name = name_win > name ? name_win : name;
+#endif
+
+    name = name ? name + 1 : input;
+    const char* start = job->keep_tree ? input : name;
+    const char* dot = strrchr(name, '.');
+    int length = job->output_suffix && dot ? (int)(dot - start) : (int)strlen(start);
+    snprintf(path, size, "%s/%.*s%s", job->output_dir, length, start, job->output_suffix ? job->output_suffix : "");
+
+    // a/x.mid и b/x.mid не должны попасть в один файл: подкаталоги входа создаются внутри OUT_DIR
+    if (job->keep_tree && name != start) {
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%s/%.*s", job->output_dir, (int)(name - 1 - start), start);
+        make_dirs(dir);
+    }
+}
+
+static int batch_worker(void* data) {
+    BatchWorker* worker = data;
+    BatchJob* job = worker->job;
+    EffectChain* chain = NULL;
+    int index;
+
+    while ((index = SDL_AtomicAdd(&job->next, 1)) < job->count) {
+        PcmBuffer pcm;
+
+        if (!pcm_load(job->inputs[index], &pcm, job->sample_rate)) {
+            SDL_AtomicIncRef(&job->failed);
+            continue;
+        }
+
+        // Контекст пересоздаётся только если у файла другая частота
+        if (!chain || chain->sample_rate != pcm.sample_rate) {
+            effect_chain_destroy(chain);
+            chain = effect_chain_create(pcm.sample_rate);
+        }
+
+        if (!chain) {
+            SDL_AtomicIncRef(&job->failed);
+            free(pcm.samples);
+            continue;
+        }
+
+        Uint64 start = SDL_GetPerformanceCounter();
+        effect_chain_reset(chain, &effect_params);
+        effect_chain_process(chain, &effect_params, pcm.samples, pcm.frames);
+        worker->busy += (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+        worker->audio += (double)pcm.frames / pcm.sample_rate;
+        worker->files++;
+
+        char path[4096];
+        batch_output_path(job, job->inputs[index], path, sizeof(path));
+
+        if (!pcm_save(path, &pcm)) { SDL_AtomicIncRef(&job->failed); }
+
+        free(pcm.samples);
+    }
+
+    effect_chain_destroy(chain);
+    return 0;
+}
+
+// Запустить worker в threads потоках (0 — по числу ядер) и напечатать отчёт
+static int batch_run(BatchJob* job, int threads, SDL_ThreadFunction worker_fn, const char* title) {
+    BatchWorker workers[BATCH_MAX_THREADS] = {0};
+    SDL_Thread* handles[BATCH_MAX_THREADS];
+
+    if (threads <= 0) { threads = SDL_GetCPUCount(); }
+
+    threads = threads > BATCH_MAX_THREADS ? BATCH_MAX_THREADS : threads;
+    threads = threads > job->count ? job->count : threads;
+
+    if (!make_dirs(job->output_dir)) {
+        fprintf(stderr, "%s: cannot create output directory %s: %s\n", title, job->output_dir, strerror(errno));
+        return 1;
+    }
+
+    SDL_AtomicSet(&job->next, 0);
+    SDL_AtomicSet(&job->failed, 0);
+    dsp_init(1);
+    printf("%s: %d files, %d threads, %s kernels\n", title, job->count, threads, dsp->name);
+    Uint64 start = SDL_GetPerformanceCounter();
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].job = job;
+        handles[i] = SDL_CreateThread(worker_fn, "fx-batch", &workers[i]);
+    }
+
+    double audio = 0.0, rate = 0.0;
+
+    for (int i = 0; i < threads; i++) {
+        if (handles[i]) { SDL_WaitThread(handles[i], NULL); }
+
+        else { worker_fn(&workers[i]); } // поток не создался: работаем сами
+
+        audio += workers[i].audio;
+        rate += workers[i].busy > 0.0 ? workers[i].audio / workers[i].busy : 0.0;
+        printf("  thread %2d: %4d files, %8.3f s processing\n", i, workers[i].files, workers[i].busy);
+    }
+
+    double wall = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    int failed = SDL_AtomicGet(&job->failed);
+
+    // Масштабирование видно по realtime на часах при разном --threads. Время потока включает вытеснение,
+    // поэтому при потоках больше, чем ядер, сумма по потокам не растёт
+    printf("  %.2f s of audio in %.3f s wall (with file I/O): realtime x%.1f, %.2f files/s\n",
+           audio, wall, audio / wall, (job->count - failed) / wall);
+    printf("  processing only: realtime x%.1f summed over threads (x%.1f per thread)\n", rate, rate / threads);
+
+    if (failed) { printf("  %d files failed\n", failed); }
+
+    return failed ? 1 : 0;
+}
+
+int run_batch(const char* output_dir, char** inputs, int count, int threads, int raw_rate) {
+    BatchJob job = { .inputs = inputs, .count = count, .output_dir = output_dir, .sample_rate = raw_rate };
+    return batch_run(&job, threads, batch_worker, "Batch");
+}
+
+/*
+    Плейлист: пути от корня каталога (с подкаталогами), упорядочены без учёта регистра (при равенстве — strcmp),
+    поэтому порядок не зависит от файловой системы и одинаков от запуска к запуску.
+    Повторы отсекаются хэш-множеством тех же строк (открытая адресация, заполнено не больше чем наполовину),
+    место для вставки ищется двоичным поиском. Удалённые ячейки множества помечаются и чистятся при перестройке.
+*/
+
+typedef struct {
+    char** files;
+    int count;
+    int capacity;
+    char** set;   // NULL — свободно, midi_set_deleted — удалено
+    int set_size; // степень двойки
+    int set_used; // занятые и удалённые
+} MidiList;
+
+static char midi_set_deleted_mark;
+#define midi_set_deleted (&midi_set_deleted_mark)
+
+static int midi_path_compare(const char* a, const char* b) {
+    int order = strcasecmp(a, b);
+    return order ? order : strcmp(a, b);
+}
+
+static int midi_path_compare_qsort(const void* a, const void* b) {
+    return midi_path_compare(*(char* const*)a, *(char* const*)b);
+}
+
+static Uint32 midi_path_hash(const char* path) {
+    return (Uint32)fnv1a(0xcbf29ce484222325ULL, path, strlen(path));
+}
+
+// Ячейка с path или NULL
+static char** midi_set_find(const MidiList* list, const char* path) {
+    for (Uint32 i = midi_path_hash(path) & (list->set_size - 1); list->set[i]; i = (i + 1) & (list->set_size - 1)) {
+        if (list->set[i] != midi_set_deleted && strcmp(list->set[i], path) == 0) { return &list->set[i]; }
+    }
+
+    return NULL;
+}
+
+static void midi_set_insert(MidiList* list, char* path) {
+    if ((list->set_used + 1) * 2 > list->set_size) {
+        // Перестроить: удвоить, если тесно от живых строк, иначе только выбросить удалённые
+        int size = list->count * 4 > list->set_size ? list->set_size * 2 : list->set_size;
+        free(list->set);
+        list->set = calloc(size, sizeof(char*));
+        list->set_size = size;
+        list->set_used = 0;
+
+        for (int i = 0; i < list->count; i++) {
+            if (list->files[i] != path) { midi_set_insert(list, list->files[i]); }
+        }
+    }
+
+    Uint32 i = midi_path_hash(path) & (list->set_size - 1);
+
+    while (list->set[i]) { i = (i + 1) & (list->set_size - 1); }
+
+    list->set[i] = path;
+    list->set_used++;
+}
+
+MidiList* midi_list_init() {
+    MidiList* list = calloc(1, sizeof(MidiList));
+    list->capacity = 16;
+    list->files = malloc(list->capacity * sizeof(char*));
+    list->set_size = 32;
+    list->set = calloc(list->set_size, sizeof(char*));
+    return list;
+}
+
+// Индекс path в списке или -1
+int midi_list_find(const MidiList* list, const char* path) {
+    int low = 0, high = list->count;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+
+        if (midi_path_compare(list->files[middle], path) < 0) { low = middle + 1; }
+
+        else { high = middle; }
+    }
+
+    return low < list->count && strcmp(list->files[low], path) == 0 ? low : -1;
+}
+
+// Добавить в конец без сортировки (для обхода каталогов, потом midi_list_sort); 0 если такой путь уже есть
+static int midi_list_push(MidiList* list, const char* path) {
+    if (midi_set_find(list, path)) { return 0; }
+
+    if (list->count >= list->capacity) {
+        list->capacity *= 2;
+        list->files = realloc(list->files, list->capacity * sizeof(char*));
+    }
+
+    list->files[list->count++] = STRDUP(path);
+    midi_set_insert(list, list->files[list->count - 1]);
+    return 1;
+}
+
+// Обход каталогов по порядку уже даёт сортированный список; qsort только если он нарушен
+// (каталоги, отличающиеся лишь регистром)
+static void midi_list_sort(MidiList* list) {
+    for (int i = 1; i < list->count; i++) {
+        if (midi_path_compare(list->files[i - 1], list->files[i]) > 0) {
+            qsort(list->files, list->count, sizeof(char*), midi_path_compare_qsort);
+            return;
+        }
+    }
+}
+
+// Вставить на место по порядку; индекс вставленного или -1, если такой путь уже есть
+int midi_list_add(MidiList* list, const char* path) {
+    if (!midi_list_push(list, path)) { return -1; }
+
+    char* added = list->files[list->count - 1];
+    int low = 0, high = list->count - 1;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+
+        if (midi_path_compare(list->files[middle], added) < 0) { low = middle + 1; }
+
+        else { high = middle; }
+    }
+
+    memmove(&list->files[low + 1], &list->files[low], (list->count - 1 - low) * sizeof(char*));
+    list->files[low] = added;
+    return low;
+}
+
+// Убрать путь с сохранением порядка; индекс удалённого или -1
+int midi_list_remove(MidiList* list, const char* path) {
+    int index = midi_list_find(list, path);
+
+    if (index < 0) { return -1; }
+
+    *midi_set_find(list, path) = midi_set_deleted;
+    free(list->files[index]);
+    memmove(&list->files[index], &list->files[index + 1], (list->count - index - 1) * sizeof(char*));
+    list->count--;
+    return index;
+}
+
+static void midi_list_clear(MidiList* list) {
+    for (int i = 0; i < list->count; i++) { free(list->files[i]); }
+
+    memset(list->set, 0, list->set_size * sizeof(char*));
+    list->count = 0;
+    list->set_used = 0;
+}
+
+// Память списка: массив, множество и строки
+static size_t midi_list_memory(const MidiList* list) {
+    size_t bytes = sizeof(MidiList) + (list->capacity + list->set_size) * sizeof(char*);
+
+    for (int i = 0; i < list->count; i++) { bytes += strlen(list->files[i]) + 1; }
+
+    return bytes;
+}
+
+void midi_list_free(MidiList* list) {
+    if (list) {
+        for (int i = 0; i < list->count; i++) { free(list->files[i]); }
+
+        free(list->files);
+        free(list->set);
+        free(list);
+    }
+}
+
+int midi_name_matches(const char* name) {
+    return has_suffix(name, ".mid") || has_suffix(name, ".midi");
+}
+
+/*
+    Индекс каталога на диске (.wavepixel_index в корне): для каждого подкаталога — время изменения и его
+    .mid-файлы и подкаталоги. Время изменения каталога меняется при добавлении, удалении и переименовании
+    записей в нём, поэтому при старте каталог с прежним временем не читается, а берётся из индекса; stat()
+    на каталог вместо readdir(). Каталог, изменённый в ту же секунду, что записан индекс (или позже),
+    читается всегда: иначе изменение в пределах секунды после записи осталось бы незамеченным.
+    Индекс пишется поверх старого, а не через временный файл и rename: новая запись в корне меняла бы его время
+    и корень читался бы при каждом старте. Недописанный индекс (нет строки E) не используется.
+    Скрытые файлы и каталоги (.git, .wavepixel_cache) пропускаются.
+
+    D <время изменения> <путь от корня>
+    F <имя .mid>
+    S <имя подкаталога>
+    E
+*/
+
+#define MIDI_INDEX_FILE ".wavepixel_index"
+#define MIDI_INDEX_HEADER "WavePixel index 1"
+
+typedef struct {
+    const char* path;
+    long long mtime;
+    char* entries; // строки "F имя" и "S имя" подряд, через '\0'
+    int count;
+} MidiIndexDir;
+
+typedef struct {
+    const char* root;
+    MidiList* list;
+    // Прочитанный индекс
+    char* text;
+    long long written;
+    MidiIndexDir* dirs;
+    int dir_count;
+    int* table; // хэш путь -> индекс в dirs, -1 — пусто
+    int table_size;
+    // Новый индекс
+    char* out;
+    size_t out_size, out_capacity;
+    int visited, reused;
+} MidiIndexScan;
+
+typedef struct {
+    char* name;
+    int is_dir;
+} MidiDirEntry;
+
+// Порядок записей каталога, при котором обход в глубину идёт в порядке midi_path_compare:
+// подкаталог сравнивается как "имя/". Строки не склеиваются — '/' подставляется вместо конца имени
+static int midi_dir_entry_compare(const void* a, const void* b) {
+    const MidiDirEntry* x = a;
+    const MidiDirEntry* y = b;
+    const unsigned char* p = (const unsigned char*)x->name;
+    const unsigned char* q = (const unsigned char*)y->name;
+    int exact = 0; // как strcmp, при равенстве без учёта регистра
+
+    for (;; p++, q++) {
+        int cp = *p ? *p : (x->is_dir ? '/' : 0);
+        int cq = *q ? *q : (y->is_dir ? '/' : 0);
+        int order = tolower(cp) - tolower(cq);
+
+        if (order) { return order; }
+
+        if (!exact) { exact = cp - cq; }
+
+        // Символы совпали, а в имени '/' не бывает: если одно имя кончилось, кончились оба
+        if (!*p || !*q) { return exact; }
+    }
+}
+
+static void midi_index_append(MidiIndexScan* scan, const char* prefix, const char* text) {
+    size_t length = strlen(prefix) + strlen(text) + 2;
+
+    if (scan->out_size + length > scan->out_capacity) {
+        scan->out_capacity = (scan->out_size + length) * 2;
+        scan->out = realloc(scan->out, scan->out_capacity);
+    }
+
+    scan->out_size += sprintf(scan->out + scan->out_size, "%s%s\n", prefix, text);
+}
+
+static void midi_index_load(MidiIndexScan* scan, const char* path) {
+    FILE* f = fopen(path, "rb");
+
+    if (!f) { return; }
+
+    // Не прочитался — как без индекса: полный обход
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    scan->text = size >= 0 && fseek(f, 0, SEEK_SET) == 0 ? malloc(size + 1) : NULL;
+    size = scan->text ? (long)fread(scan->text, 1, size, f) : 0;
+    fclose(f);
+
+    int capacity = 16;
+    scan->dirs = scan->text ? malloc(capacity * sizeof(MidiIndexDir)) : NULL;
+
+    if (!scan->dirs) {
+        free(scan->text);
+        scan->text = NULL;
+        return;
+    }
+
+    // Строки в '\0', записи D с их F/S сразу за ними
+    scan->text[size] = '\0';
+    char* line = scan->text;
+    int valid = 0, complete = 0;
+
+    while (*line) {
+        char* end = strchr(line, '\n');
+
+        if (!end) { break; }
+
+        *end = '\0';
+
+        if (!valid) { valid = sscanf(line, MIDI_INDEX_HEADER " %lld", &scan->written) == 1; }
+
+        else if (line[0] == 'D' && line[1] == ' ') {
+            if (scan->dir_count >= capacity) {
+                capacity *= 2;
+                scan->dirs = realloc(scan->dirs, capacity * sizeof(MidiIndexDir));
+            }
+
+            MidiIndexDir* dir = &scan->dirs[scan->dir_count++];
+            char* path_start = strchr(line + 2, ' ');
+            dir->mtime = strtoll(line + 2, NULL, 10);
+            dir->path = path_start ? path_start + 1 : "";
+            dir->entries = end + 1;
+            dir->count = 0;
+        }
+
+        else if (scan->dir_count > 0 && (line[0] == 'F' || line[0] == 'S') && line[1] == ' ') {
+            scan->dirs[scan->dir_count - 1].count++;
+        }
+
+        else if (strcmp(line, "E") == 0) { complete = 1; }
+
+        line = end + 1;
+    }
+
+    if (!valid || !complete) { scan->dir_count = 0; }
+
+    for (scan->table_size = 16; scan->table_size < scan->dir_count * 2; scan->table_size *= 2) {}
+
+    scan->table = malloc(scan->table_size * sizeof(int));
+    memset(scan->table, 0xff, scan->table_size * sizeof(int));
+
+    for (int i = 0; i < scan->dir_count; i++) {
+        Uint32 slot = midi_path_hash(scan->dirs[i].path) & (scan->table_size - 1);
+
+        while (scan->table[slot] >= 0) { slot = (slot + 1) & (scan->table_size - 1); }
+
+        scan->table[slot] = i;
+    }
+}
+
+static const MidiIndexDir* midi_index_lookup(const MidiIndexScan* scan, const char* path) {
+    if (!scan->table) { return NULL; }
+
+    for (Uint32 slot = midi_path_hash(path) & (scan->table_size - 1); scan->table[slot] >= 0; slot = (slot + 1) & (scan->table_size - 1)) {
+        if (strcmp(scan->dirs[scan->table[slot]].path, path) == 0) { return &scan->dirs[scan->table[slot]]; }
+    }
+
+    return NULL;
+}
+
+static void midi_path_join(char* path, size_t size, const char* dir, const char* name) {
+    snprintf(path, size, dir[0] && strcmp(dir, ".") != 0 ? "%s/%s" : "%.0s%s", dir, name);
+}
+
+// Прочитать каталог с диска: .mid-файлы и подкаталоги; число записей, -1 если не открылся
+static int midi_dir_read(const char* path, MidiDirEntry** entries) {
+    int count = 0, capacity = 16;
+    *entries = malloc(capacity * sizeof(MidiDirEntry));
+#ifdef _WIN32
+    char pattern[4096];
+    WIN32_FIND_DATAA fd;
+    snprintf(pattern, sizeof(pattern), "%s\\*", path);
+    HANDLE find = FindFirstFileA(pattern, &fd);
+
+    if (find == INVALID_HANDLE_VALUE) { return -1; }
+
+    do {
+        const char* name = fd.cFileName;
+        int is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    DIR* dir = opendir(path);
+
+    if (!dir) { return -1; }
+
+    struct dirent* entry;
+
+    while ((entry = readdir(dir))) {
+        const char* name = entry->d_name;
+        int is_dir = entry->d_type == DT_DIR;
+
+        // Файловые системы без d_type
+        if (entry->d_type == DT_UNKNOWN) {
+            char full[4096];
+            struct stat st;
+            midi_path_join(full, sizeof(full), path, name);
+            is_dir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+
+#endif
+
+        if (name[0] != '.' && !strchr(name, '\n') && (is_dir || midi_name_matches(name))) {
+            if (count >= capacity) {
+                capacity *= 2;
+                *entries = realloc(*entries, capacity * sizeof(MidiDirEntry));
+            }
+
+            (*entries)[count].name = STRDUP(name);
+            (*entries)[count++].is_dir = is_dir;
+        }
+#ifdef _WIN32
+    }
+    while (FindNextFileA(find, &fd));
+
+    FindClose(find);
+#else
+    }
+
+    closedir(dir);
+#endif
+    return count;
+}
+
+void midi_watch_add(const char* path);
+
+static void midi_index_scan_dir(MidiIndexScan* scan, const char* path) {
+    char full[4096], child[4096], prefix[32];
+    struct stat st;
+    midi_path_join(full, sizeof(full), scan->root, path[0] ? path : ".");
+
+    if (stat(full, &st) != 0 || !S_ISDIR(st.st_mode)) { return; }
+
+    midi_watch_add(path);
+    const MidiIndexDir* cached = midi_index_lookup(scan, path);
+    MidiDirEntry* entries = NULL;
+    int count, reused = cached && cached->mtime == (long long)st.st_mtime && cached->mtime < scan->written;
+    scan->visited++;
+
+    if (reused) {
+        const char* line = cached->entries;
+        count = 0;
+        entries = malloc((cached->count + 1) * sizeof(MidiDirEntry));
+
+        // Только записи F/S этого каталога, до следующего заголовка D; прочие строки пропускаются, как при загрузке
+        for (; count < cached->count && !(line[0] == 'D' && line[1] == ' '); line += strlen(line) + 1) {
+            if ((line[0] == 'F' || line[0] == 'S') && line[1] == ' ') {
+                entries[count].name = (char*)line + 2;
+                entries[count++].is_dir = line[0] == 'S';
+            }
+        }
+
+        scan->reused++;
+    }
+
+    else if ((count = midi_dir_read(full, &entries)) < 0) {
+        free(entries);
+        return;
+    }
+
+    else { qsort(entries, count, sizeof(MidiDirEntry), midi_dir_entry_compare); }
+
+    snprintf(prefix, sizeof(prefix), "D %lld ", (long long)st.st_mtime);
+    midi_index_append(scan, prefix, path);
+
+    for (int i = 0; i < count; i++) { midi_index_append(scan, entries[i].is_dir ? "S " : "F ", entries[i].name); }
+
+    for (int i = 0; i < count; i++) {
+        midi_path_join(child, sizeof(child), path, entries[i].name);
+
+        if (entries[i].is_dir) { midi_index_scan_dir(scan, child); }
+
+        else { midi_list_push(scan->list, child); }
+    }
+
+    // Имена из индекса указывают в его текст
+    for (int i = 0; i < count && !reused; i++) { free(entries[i].name); }
+
+    free(entries);
+}
+
+// Обойти root рекурсивно в list (сортированный), с индексом root/.wavepixel_index; индекс перезаписывается,
+// если хоть один каталог пришлось читать или набор каталогов изменился
+void midi_index_scan(MidiList* list, const char* root, int* visited, int* reused) {
+    char path[4096], started[32];
+    MidiIndexScan scan = { .root = root, .list = list };
+    FILE* f;
+    snprintf(started, sizeof(started), "%lld", (long long)time(NULL));
+    midi_path_join(path, sizeof(path), root, MIDI_INDEX_FILE);
+    midi_index_load(&scan, path);
+    midi_list_clear(list);
+    midi_index_append(&scan, MIDI_INDEX_HEADER " ", started);
+    midi_index_scan_dir(&scan, "");
+    midi_index_append(&scan, "E", "");
+    midi_list_sort(list);
+
+    if ((scan.reused < scan.visited || scan.dir_count != scan.visited) && (f = fopen(path, "wb"))) {
+        fwrite(scan.out, 1, scan.out_size, f);
+        fclose(f);
+    }
+
+    if (visited) { *visited = scan.visited; }
+
+    if (reused) { *reused = scan.reused; }
+
+    free(scan.text);
+    free(scan.dirs);
+    free(scan.table);
+    free(scan.out);
+}
+
+void update_midi_list(MidiList* list) {
+    midi_index_scan(list, ".", NULL, NULL);
+}
+
+// Полный обход, текущий трек остаётся на том же файле, если он никуда не делся
+void midi_list_rescan(MidiList* list, int* current_track) {
+    char* current = list->count > 0 ? STRDUP(list->files[*current_track]) : NULL;
+    update_midi_list(list);
+    int found = current ? midi_list_find(list, current) : -1;
+    *current_track = found >= 0 ? found : (*current_track < list->count ? *current_track : 0);
+    free(current);
+}
+
+// --scan DIR: обойти каталог через индекс и сообщить время, память и цену проверки на повтор
+int run_scan(const char* root) {
+    MidiList* list = midi_list_init();
+    int visited, reused;
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    Uint64 start = SDL_GetPerformanceCounter();
+    midi_index_scan(list, root, &visited, &reused);
+    double scan_ms = (SDL_GetPerformanceCounter() - start) * 1000.0 / frequency;
+
+    start = SDL_GetPerformanceCounter();
+    int found = 0;
+
+    for (int i = 0; i < list->count; i++) { found += midi_set_find(list, list->files[i]) != NULL; }
+
+    double lookup_ns = list->count ? (SDL_GetPerformanceCounter() - start) * 1e9 / frequency / list->count : 0.0;
+    size_t memory = midi_list_memory(list);
+    printf("Scan: %s\n", root);
+    printf("  %d MIDI files in %d directories (%d from %s, %d read)\n", list->count, visited, reused, MIDI_INDEX_FILE, visited - reused);
+    printf("  %.1f ms, playlist %.2f MiB (%.0f bytes per file), dedupe lookup %.0f ns (%d/%d found)\n",
+           scan_ms, memory / 1048576.0, list->count ? (double)memory / list->count : 0.0, lookup_ns, found, list->count);
+
+    for (int i = 0; i < list->count && i < 3; i++) { printf("  %s\n", list->files[i]); }
+
+    if (list->count > 3) { printf("  ...\n  %s\n", list->files[list->count - 1]); }
+
+    midi_list_free(list);
+    return 0;
 }
 
 char* find_soundfont() {
 #ifdef _WIN32
-    WIN32_FIND_DATA fd;
-    HANDLE hFind = FindFirstFile("*.sf2", &fd);
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = FindFirstFile("*.sf2", &fd);
+
+    if (hFind != INVALID_HANDLE_VALUE) {
+        char* sf2 = STRDUP(fd.cFileName);
+        FindClose(hFind);
+        return sf2;
+    }
+
+#else
+    DIR* dir = opendir(".");
+
+    if (dir) {
+        struct dirent* entry;
+
+        while ((entry = readdir(dir))) {
+            char* name = entry->d_name;
+            size_t len = strlen(name);
+
+            if (len >= 4 && strcasecmp(name + len - 4, ".sf2") == 0) {
+                char* sf2 = STRDUP(name);
+                closedir(dir);
+                return sf2;
+            }
+        }
+
+        closedir(dir);
+    }
+
+#endif
+    return NULL;
+}
+
+/*
+    Слежение за каталогом: на Linux — inotify на корень и каждый подкаталог (их добавляет обход), события
+    применяются к списку по одному, без пересканирования. Файл добавляется, когда его закрыли после записи
+    или переместили в каталог (недописанный .mid не играем), и убирается при удалении или перемещении.
+    Появление или исчезновение подкаталога и переполнение очереди событий — полный обход через индекс
+    (читаются только изменившиеся каталоги). Опрос — один неблокирующий read() за кадр.
+    На других системах остаётся обход раз в 5 секунд.
+*/
+
+static struct {
+    int fd;
+    int* wds;    // дескриптор наблюдения -> каталог от корня ("" — корень)
+    char** dirs;
+    int count, capacity;
+} midi_watch = { .fd = -1 };
+
+// Начать слежение; вызывать до первого обхода, он добавит каталоги
+int midi_watch_init() {
+#ifdef __linux__
+    midi_watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    return midi_watch.fd >= 0;
+}
+
+// Следить за каталогом path (от корня "."); вызывается обходом
+void midi_watch_add(const char* path) {
+#ifdef __linux__
+
+    if (midi_watch.fd < 0) { return; }
+
+    int wd = inotify_add_watch(midi_watch.fd, path[0] ? path : ".",
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_CREATE | IN_ONLYDIR);
+
+    for (int i = 0; i < midi_watch.count; i++) {
+        if (midi_watch.wds[i] == wd) { return; }
+    }
+
+    if (wd < 0) {
+        printf("Warning: Can't watch %s (%s), new files there show up on restart\n", path[0] ? path : ".", strerror(errno));
+        return;
+    }
+
+    if (midi_watch.count >= midi_watch.capacity) {
+        midi_watch.capacity = midi_watch.capacity ? midi_watch.capacity * 2 : 16;
+        midi_watch.wds = realloc(midi_watch.wds, midi_watch.capacity * sizeof(int));
+        midi_watch.dirs = realloc(midi_watch.dirs, midi_watch.capacity * sizeof(char*));
+    }
+
+    midi_watch.wds[midi_watch.count] = wd;
+    midi_watch.dirs[midi_watch.count++] = STRDUP(path);
+#else
+    (void)path;
+#endif
+}
+
+static void midi_watch_forget(int index) {
+    free(midi_watch.dirs[index]);
+    midi_watch.wds[index] = midi_watch.wds[--midi_watch.count];
+    midi_watch.dirs[index] = midi_watch.dirs[midi_watch.count];
+}
+
+void midi_watch_close() {
+#ifdef __linux__
+
+    if (midi_watch.fd >= 0) { close(midi_watch.fd); }
+
+#endif
+
+    for (int i = 0; i < midi_watch.count; i++) { free(midi_watch.dirs[i]); }
+
+    free(midi_watch.wds);
+    free(midi_watch.dirs);
+    memset(&midi_watch, 0, sizeof(midi_watch));
+    midi_watch.fd = -1;
+}
+
+// Применить накопившиеся события к списку; current_track остаётся на том же файле (или 0 в пустом списке)
+void midi_watch_poll(MidiList* list, int* current_track) {
+#ifdef __linux__
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    int rescan = 0;
+
+    while ((length = read(midi_watch.fd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            int watch = -1;
+            char path[4096];
+
+            for (int i = 0; i < midi_watch.count && watch < 0; i++) {
+                if (midi_watch.wds[i] == event->wd) { watch = i; }
+            }
+
+            // Каталог удалён или перемещён: его наблюдение снято ядром
+            if (event->mask & IN_IGNORED) {
+                if (watch >= 0) { midi_watch_forget(watch); }
+
+                continue;
+            }
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan = 1;
+                continue;
+            }
+
+            if (watch < 0 || event->len == 0 || event->name[0] == '.') { continue; }
+
+            midi_path_join(path, sizeof(path), midi_watch.dirs[watch], event->name);
+
+            if (event->mask & IN_ISDIR) {
+                // Каталог ушёл из дерева, но продолжает существовать: снять наблюдение с него и вложенных
+                if (event->mask & IN_MOVED_FROM) {
+                    size_t prefix = strlen(path);
+
+                    for (int i = midi_watch.count - 1; i >= 0; i--) {
+                        if (strncmp(midi_watch.dirs[i], path, prefix) == 0 && (midi_watch.dirs[i][prefix] == '\0' || midi_watch.dirs[i][prefix] == '/')) {
+                            inotify_rm_watch(midi_watch.fd, midi_watch.wds[i]);
+                        }
+                    }
+                }
+
+                rescan = 1;
+            }
+
+            else if (!midi_name_matches(event->name) || (event->mask & IN_CREATE)) { continue; }
+
+            else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                int added = midi_list_add(list, path);
+
+                if (added >= 0) {
+                    // Вставка перед текущим сдвигает его; в пустом списке текущим становится новый файл
+                    if (added <= *current_track && list->count > 1) { (*current_track)++; }
+
+                    printf("MIDI added: %s\n", path);
+                }
+            }
+
+            else {
+                int removed = midi_list_remove(list, path);
+
+                if (removed >= 0) {
+                    if (removed < *current_track) { (*current_track)--; }
+
+                    if (*current_track >= list->count) { *current_track = 0; }
+
+                    printf("MIDI removed: %s\n", path);
+                }
+            }
+        }
+    }
+
+    if (rescan) {
+        midi_list_rescan(list, current_track);
+        printf("MIDI directory rescanned: %d files\n", list->count);
+    }
+
+#else
+    (void)list; (void)current_track;
+#endif
+}
+
+/*
+    Запекание MIDI в PCM без звуковой карты:
+
+    ./wavepixel [--threads N] [--rate HZ] --bake OUT_DIR [--raw]
+
+    Берёт те же файлы, что update_midi_list(), и SoundFont из find_soundfont(), синтезирует их
+    и пропускает через цепочку эффектов; результат — OUT_DIR/путь/имя.wav (или .raw), подкаталоги как у .mid.
+    После конца MIDI рендер продолжается, пока затухают ноты синтезатора, эхо и реверберация: до тишины
+    на длину линий задержки цепочки, но не дольше BAKE_MAX_TAIL секунд.
+    SDL_mixer не рендерит быстрее реального времени и держит один синтезатор на процесс, поэтому синтез идёт
+    напрямую через FluidSynth (тот же движок, которым SDL_mixer играет .sf2): по синтезатору и EffectChain
+    на поток, время MIDI-плеера считается по отсчётам синтезатора, а не по системным часам.
+    Нужна сборка с -DWAVEPIXEL_BAKE и -lfluidsynth. Каждый поток загружает SoundFont сам — память x потоки.
+*/
+
+#ifdef WAVEPIXEL_BAKE
+
+#define BAKE_SILENCE  4  // |отсчёт| не больше этого — тишина (около -78 dBFS)
+#define BAKE_MAX_TAIL 10 // секунд хвоста после конца MIDI, даже если тишины так и не было
+
+// Синтезатор для офлайн-рендера: частота как у цепочки, время плеера по отсчётам; NULL если SoundFont не загрузился
+static fluid_synth_t* bake_synth_create(fluid_settings_t** settings, const char* soundfont, int sample_rate) {
+    *settings = new_fluid_settings();
+    fluid_settings_setnum(*settings, "synth.sample-rate", sample_rate);
+    fluid_settings_setstr(*settings, "player.timing-source", "sample");
+    fluid_settings_setint(*settings, "synth.lock-memory", 0);
+    fluid_settings_setnum(*settings, "synth.gain", 1.2); // как у SDL_mixer при громкости музыки MIX_MAX_VOLUME
+    fluid_synth_t* synth = new_fluid_synth(*settings);
+
+    if (synth && fluid_synth_sfload(synth, soundfont, 1) == FLUID_FAILED) {
+        delete_fluid_synth(synth);
+        synth = NULL;
+    }
+
+    if (!synth) { fprintf(stderr, "Bake: cannot load SoundFont %s\n", soundfont); }
+
+    return synth;
+}
+
+// Один трек: синтез, эффекты с params, запись в path (WAV или raw). cancel — прервать (может быть NULL)
+static int bake_track(fluid_synth_t* synth, EffectChain* chain, const EffectParams* params, const char* input,
+                      const char* path, int wav, SDL_atomic_t* cancel, Uint32* frames) {
+    FILE* f = fopen(path, "wb");
+    fluid_player_t* player = new_fluid_player(synth);
+    *frames = 0;
+
+    if (!f || !player || fluid_player_add(player, input) != FLUID_OK) {
+        fprintf(stderr, "Bake: cannot render %s to %s\n", input, path);
+
+        if (f) { fclose(f); }
+
+        if (player) { delete_fluid_player(player); }
+
+        return 0;
+    }
+
+    Uint8 header[WAV_HEADER_SIZE] = {0};
+    int ok = !wav || fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    Sint16 block[AUDIO_BLOCK_FRAMES * 2];
+    // Эхо может вернуться после паузы длиной в линию задержки: тишина должна продержаться дольше самой длинной
+    int silence_needed = (int)(chain->dry_history.mask + 1 + chain->reverb_history.mask + 1);
+    int silence = 0, tail = 0;
+    fluid_synth_system_reset(synth);
+    effect_chain_reset(chain, params);
+    fluid_player_play(player);
+
+    while (ok && silence < silence_needed && tail < BAKE_MAX_TAIL * chain->sample_rate && !(cancel && SDL_AtomicGet(cancel))) {
+        int playing = fluid_player_get_status(player) == FLUID_PLAYER_PLAYING;
+        int peak = 0;
+        fluid_synth_write_s16(synth, AUDIO_BLOCK_FRAMES, block, 0, 2, block, 1, 2);
+        effect_chain_process(chain, params, block, AUDIO_BLOCK_FRAMES);
+        ok = fwrite(block, sizeof(block), 1, f) == 1;
+        *frames += AUDIO_BLOCK_FRAMES;
+
+        if (playing) { continue; }
+
+        for (int i = 0; i < AUDIO_BLOCK_FRAMES * 2; i++) { peak = abs(block[i]) > peak ? abs(block[i]) : peak; }
+
+        silence = peak <= BAKE_SILENCE ? silence + AUDIO_BLOCK_FRAMES : 0;
+        tail += AUDIO_BLOCK_FRAMES;
+    }
+
+    ok = ok && !(cancel && SDL_AtomicGet(cancel));
+    delete_fluid_player(player);
+
+    if (ok && wav) {
+        wav_header(header, *frames, chain->sample_rate);
+        ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(header, 1, sizeof(header), f) == sizeof(header);
+    }
+
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok && !(cancel && SDL_AtomicGet(cancel))) { fprintf(stderr, "Write error: %s\n", path); }
+
+    return ok;
+}
+
+static int bake_worker(void* data) {
+    BatchWorker* worker = data;
+    BatchJob* job = worker->job;
+    fluid_settings_t* settings;
+    fluid_synth_t* synth = bake_synth_create(&settings, job->soundfont, job->sample_rate);
+    EffectChain* chain = effect_chain_create(job->sample_rate);
+    int wav = strcmp(job->output_suffix, ".wav") == 0;
+    int index;
+
+    while ((index = SDL_AtomicAdd(&job->next, 1)) < job->count) {
+        // SoundFont у всех потоков один: если не загрузился здесь, не загрузится нигде — оставшиеся файлы не обработать
+        if (!synth || !chain) {
+            SDL_AtomicIncRef(&job->failed);
+            continue;
+        }
+
+        char path[4096];
+        Uint32 frames;
+        batch_output_path(job, job->inputs[index], path, sizeof(path));
+        Uint64 start = SDL_GetPerformanceCounter();
+        int ok = bake_track(synth, chain, &effect_params, job->inputs[index], path, wav, NULL, &frames);
+        worker->busy += (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+        if (!ok) {
+            SDL_AtomicIncRef(&job->failed);
+            continue;
+        }
+
+        worker->audio += (double)frames / job->sample_rate;
+        worker->files++;
+    }
+
+    effect_chain_destroy(chain);
+
+    if (synth) { delete_fluid_synth(synth); }
+
+    delete_fluid_settings(settings);
+    return 0;
+}
+
+#endif
+
+int run_bake(const char* output_dir, int raw, int sample_rate, int threads) {
+#ifdef WAVEPIXEL_BAKE
+    MidiList* midi_list = midi_list_init();
+    char* soundfont = find_soundfont();
+    update_midi_list(midi_list);
+
+    if (!soundfont || midi_list->count == 0) {
+        fprintf(stderr, "Bake: need .mid files and a .sf2 SoundFont in the program directory\n");
+        free(soundfont);
+        midi_list_free(midi_list);
+        return 1;
+    }
+
+    printf("Bake: SoundFont %s, %d Hz, output %s/*%s\n", soundfont, sample_rate, output_dir, raw ? ".raw" : ".wav");
+    BatchJob job = {
+        .inputs = midi_list->files, .count = midi_list->count, .output_dir = output_dir,
+        .output_suffix = raw ? ".raw" : ".wav", .soundfont = soundfont, .sample_rate = sample_rate, .keep_tree = 1
+    };
+    int result = batch_run(&job, threads, bake_worker, "Bake");
+    free(soundfont);
+    midi_list_free(midi_list);
+    return result;
+#else
+    (void)output_dir; (void)raw; (void)sample_rate; (void)threads;
+    fprintf(stderr, "--bake is not available: rebuild with -DWAVEPIXEL_BAKE and -lfluidsynth\n");
+    return 1;
+#endif
+}
+
+/*
+    Кэш готовых треков: синтезированный и обработанный эффектами звук в .wavepixel_cache/<ключ>.wav.
+    Ключ — FNV-1a по содержимому .mid, имени, размеру и времени изменения .sf2 (сам SoundFont на сотни мегабайт
+    не хэшируется), частоте устройства и параметрам эффектов, кроме громкости и лимитера. В кэше — выход цепочки
+    до лимитера при громкости 1 / TRACK_CACHE_HEADROOM (запас, чтобы не срезать пики). Цепочка для такого трека
+    выключена (chain_bypass), а громкость и лимитер работают вживую, как у синтезатора: стадии до лимитера
+    линейны, так что звук совпадает с живым при любой громкости (кроме шума квантования на 12 dB выше).
+    Попадание: WAV отображается в память и играется через Mix_LoadMUS_RW без синтезатора.
+    Промах: трек играет как раньше через синтезатор, а фоновый поток с низким приоритетом рендерит его
+    в кэш (временный файл + rename). Рендер в фоне требует сборки с -DWAVEPIXEL_BAKE, без неё кэш только читается.
+*/
+
+#define TRACK_CACHE_DIR ".wavepixel_cache"
+#define TRACK_CACHE_QUEUE 16
+#define TRACK_CACHE_HASHES 256 // запомненных хэшей .mid, степень двойки
+#define TRACK_CACHE_FORMAT 2 // входит в ключ: файлы прежнего формата (с лимитером) больше не находятся
+
+typedef struct {
+    char midi[1024];
+    char path[1024];
+    EffectParams params;
+} TrackCacheJob;
+
+typedef struct {
+    Uint64 path; // FNV-1a пути
+    long long size, mtime;
+    Uint64 hash; // содержимое .mid вместе с SoundFont
+} TrackCacheHash;
+
+static struct {
+    int enabled;
+    Uint64 soundfont_hash;
+    char* soundfont;
+    SDL_Thread* thread;
+    SDL_mutex* lock;
+    SDL_cond* wake;
+    TrackCacheJob queue[TRACK_CACHE_QUEUE];
+    int head, count; // под lock
+    SDL_atomic_t quit;
+    // Хэш содержимого .mid по пути, пока не изменились размер и время: без него каждая загрузка читала весь файл.
+    // Пишут главный поток и поток загрузки, поэтому под своей блокировкой
+    SDL_mutex* hash_lock;
+    TrackCacheHash hashes[TRACK_CACHE_HASHES];
+} track_cache;
+
+typedef struct {
+    Mix_Music* music;
+    char* midi;          // исходный файл
+    Uint64 params_hash;  // параметры эффектов при открытии (важны только для кэшированного звука)
+    void* map; // WAV из кэша, отображённый в память; NULL — трек играет синтезатор
+    size_t size;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} Track;
+
+// Параметры, от которых зависит звук в кэше (громкость, лимитер и chain_bypass не входят)
+static Uint64 effect_params_hash(Uint64 hash, const EffectParams* p) {
+    float values[] = { p->reverb_level, p->reverb_feedback, p->reverb_damping, p->chorus_level, p->chorus_depth,
+                       p->chorus_speed, p->stereo_width };
+    int switches[] = { p->reverb_enabled, p->chorus_enabled, p->stereo_enabled,
+                       p->vibrato_enabled, p->tremolo_enabled, p->echo_enabled };
+    hash = fnv1a(hash, values, sizeof(values));
+    hash = fnv1a(hash, switches, sizeof(switches));
+    return fnv1a(hash, p->order, sizeof(p->order));
+}
+
+static Uint64 track_params_hash(const EffectParams* params) {
+    return effect_params_hash(0xcbf29ce484222325ULL, params);
+}
+
+// Хэш содержимого midi (с SoundFont), из памяти, если файл не менялся; 0 если .mid не читается
+static int track_cache_midi_hash(const char* midi, Uint64* hash) {
+    struct stat st;
+    Uint64 key = fnv1a(0xcbf29ce484222325ULL, midi, strlen(midi));
+
+    if (stat(midi, &st) != 0) { return 0; }
+
+    SDL_LockMutex(track_cache.hash_lock);
+    TrackCacheHash* slot = &track_cache.hashes[key & (TRACK_CACHE_HASHES - 1)];
+    int known = slot->path == key && slot->size == (long long)st.st_size && slot->mtime == (long long)st.st_mtime;
+    *hash = slot->hash;
+    SDL_UnlockMutex(track_cache.hash_lock);
+
+    if (known) { return 1; }
+
+    FILE* f = fopen(midi, "rb");
+
+    if (!f) { return 0; }
+
+    Uint8 buffer[4096];
+    size_t n;
+    *hash = track_cache.soundfont_hash;
+
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) { *hash = fnv1a(*hash, buffer, n); }
+
+    fclose(f);
+    SDL_LockMutex(track_cache.hash_lock);
+    slot->path = key;
+    slot->size = (long long)st.st_size;
+    slot->mtime = (long long)st.st_mtime;
+    slot->hash = *hash;
+    SDL_UnlockMutex(track_cache.hash_lock);
+    return 1;
+}
+
+// Путь к файлу кэша для midi при параметрах params; 0 если .mid не читается
+static int track_cache_path(const char* midi, const EffectParams* params, char* path, size_t size) {
+    Uint64 hash;
+    int format = TRACK_CACHE_FORMAT;
+
+    if (!track_cache_midi_hash(midi, &hash)) { return 0; }
+
+    hash = fnv1a(hash, &audio_format.sample_rate, sizeof(audio_format.sample_rate));
+    hash = fnv1a(hash, &format, sizeof(format));
+    hash = effect_params_hash(hash, params);
+    snprintf(path, size, "%s/%016llx.wav", TRACK_CACHE_DIR, (unsigned long long)hash);
+    return 1;
+}
+
+void track_close(Track* track) {
+    if (track->music) { Mix_FreeMusic(track->music); }
+
+    free(track->midi);
+
+    if (track->map) {
+#ifdef _WIN32
+        UnmapViewOfFile(track->map);
+        CloseHandle(track->mapping);
+#else
+        munmap(track->map, track->size);
+#endif
+    }
+
+    memset(track, 0, sizeof(*track));
+}
+
+// WAV из кэша подходит устройству: PCM S16 стерео на частоте audio_format, есть блок data.
+// Иначе SDL_mixer молча передискретизирует чужой или устаревший файл, а цепочка для него выключена
+static int track_cache_wav_ok(const Uint8* data, size_t size) {
+    size_t pos = 12;
+    int format_ok = 0;
+
+    if (size < WAV_HEADER_SIZE || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) { return 0; }
+
+    while (pos + 8 <= size) {
+        Uint32 chunk_size = read_le32(data + pos + 4);
+        const Uint8* chunk = data + pos + 8;
+
+        if (memcmp(data + pos, "data", 4) == 0) { return format_ok; }
+
+        if (chunk_size > size - pos - 8) { return 0; }
+
+        if (memcmp(data + pos, "fmt ", 4) == 0) {
+            format_ok = chunk_size >= 16 && read_le16(chunk) == 1 && read_le16(chunk + 2) == 2 &&
+                        read_le32(chunk + 4) == (Uint32)audio_format.sample_rate && read_le16(chunk + 14) == 16;
+        }
+
+        pos += 8 + (size_t)chunk_size + (chunk_size & 1);
+    }
+
+    return 0;
+}
+
+static int track_map(Track* track, const char* path) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE) { return 0; }
+
+    LARGE_INTEGER size;
+    track->mapping = GetFileSizeEx(file, &size) ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    CloseHandle(file);
+
+    if (!track->mapping) { return 0; }
+
+    track->size = (size_t)size.QuadPart;
+    track->map = MapViewOfFile(track->mapping, FILE_MAP_READ, 0, 0, 0);
+
+    if (!track->map) {
+        CloseHandle(track->mapping);
+        return 0;
+    }
+
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0) { return 0; }
+
+    void* map = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (map == MAP_FAILED) { return 0; }
+
+    track->map = map;
+    track->size = st.st_size;
+#endif
+
+    // Недописанный, чужой или не под это устройство файл — как промах; SDL_RWFromConstMem берёт размер в int
+    if (track->size > INT_MAX || !track_cache_wav_ok(track->map, track->size)) {
+        track_close(track);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void track_cache_request(const char* midi, const char* path, const EffectParams* params) {
+    if (!track_cache.thread) { return; }
+
+    SDL_LockMutex(track_cache.lock);
+    int queued = 0;
+
+    for (int i = 0; i < track_cache.count; i++) {
+        queued |= strcmp(track_cache.queue[(track_cache.head + i) % TRACK_CACHE_QUEUE].path, path) == 0;
+    }
+
+    if (!queued && track_cache.count < TRACK_CACHE_QUEUE) {
+        TrackCacheJob* job = &track_cache.queue[(track_cache.head + track_cache.count) % TRACK_CACHE_QUEUE];
+        snprintf(job->midi, sizeof(job->midi), "%s", midi);
+        snprintf(job->path, sizeof(job->path), "%s", path);
+        job->params = *params;
+        job->params.global_volume = 1.0f / TRACK_CACHE_HEADROOM;
+        job->params.limiter_enabled = 0; // выключенный лимитер — только задержка, усиление 1
+        job->params.chain_bypass = 0;
+        track_cache.count++;
+        SDL_CondSignal(track_cache.wake);
+    }
+
+    SDL_UnlockMutex(track_cache.lock);
+}
+
+// Загрузить midi в пустой track: из кэша, если есть, иначе через синтезатор (и заказать рендер в кэш).
+// effect_params не трогает, поэтому годится и для потока предзагрузки
+static int track_load(Track* track, const char* midi, const EffectParams* params) {
+    char path[1024];
+
+    if (track_cache.enabled && track_cache_path(midi, params, path, sizeof(path))) {
+        if (track_map(track, path)) {
+            track->music = Mix_LoadMUS_RW(SDL_RWFromConstMem(track->map, (int)track->size), 1);
+
+            if (!track->music) { track_close(track); }
+        }
+
+        if (!track->music) { track_cache_request(midi, path, params); }
+    }
+
+    if (!track->music) { track->music = Mix_LoadMUS(midi); }
+
+    if (track->music) {
+        track->midi = STRDUP(midi);
+        track->params_hash = track_params_hash(params);
+    }
+
+    return track->music != NULL;
+}
+
+#ifdef WAVEPIXEL_BAKE
+
+static int track_cache_worker(void* data) {
+    (void)data;
+    fluid_settings_t* settings = NULL;
+    fluid_synth_t* synth = NULL;
+    EffectChain* chain = effect_chain_create(audio_format.sample_rate);
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    SDL_LockMutex(track_cache.lock);
+
+    while (!SDL_AtomicGet(&track_cache.quit)) {
+        if (track_cache.count == 0) {
+            SDL_CondWait(track_cache.wake, track_cache.lock);
+            continue;
+        }
+
+        TrackCacheJob job = track_cache.queue[track_cache.head];
+        SDL_UnlockMutex(track_cache.lock);
+
+        // SoundFont загружается при первом промахе, а не при старте
+        if (!synth && !settings) { synth = bake_synth_create(&settings, track_cache.soundfont, audio_format.sample_rate); }
+
+        char temp[1100];
+        Uint32 frames;
+        snprintf(temp, sizeof(temp), "%s.tmp", job.path);
+
+        if (synth && chain && bake_track(synth, chain, &job.params, job.midi, temp, 1, &track_cache.quit, &frames)) {
+            remove(job.path); // rename на Windows не заменяет существующий файл
+            rename(temp, job.path);
+            printf("Cached: %s (%.1f s)\n", job.midi, (double)frames / audio_format.sample_rate);
+        }
+
+        else { remove(temp); }
+
+        SDL_LockMutex(track_cache.lock);
+        track_cache.head = (track_cache.head + 1) % TRACK_CACHE_QUEUE;
+        track_cache.count--;
+    }
+
+    SDL_UnlockMutex(track_cache.lock);
+    effect_chain_destroy(chain);
+
+    if (synth) { delete_fluid_synth(synth); }
+
+    if (settings) { delete_fluid_settings(settings); }
+
+    return 0;
+}
+
+#endif
+
+// Включить кэш для текущего SoundFont; вызывается после открытия звука (нужна частота устройства)
+void track_cache_init(const char* soundfont) {
+    struct stat st;
+    track_cache.soundfont_hash = fnv1a(0xcbf29ce484222325ULL, soundfont, strlen(soundfont));
+
+    if (stat(soundfont, &st) == 0) {
+        long long identity[2] = { (long long)st.st_size, (long long)st.st_mtime };
+        track_cache.soundfont_hash = fnv1a(track_cache.soundfont_hash, identity, sizeof(identity));
+    }
+
+#ifdef _WIN32
+    CreateDirectoryA(TRACK_CACHE_DIR, NULL);
+#else
+    mkdir(TRACK_CACHE_DIR, 0755);
+#endif
+
+    track_cache.enabled = 1;
+    track_cache.soundfont = STRDUP(soundfont);
+    track_cache.hash_lock = SDL_CreateMutex();
+#ifdef WAVEPIXEL_BAKE
+    track_cache.lock = SDL_CreateMutex();
+    track_cache.wake = SDL_CreateCond();
+    SDL_AtomicSet(&track_cache.quit, 0);
+    track_cache.thread = SDL_CreateThread(track_cache_worker, "track-cache", NULL);
+    printf("Track cache: %s/\n", TRACK_CACHE_DIR);
+#else
+    printf("Track cache: %s/ (read-only: build with -DWAVEPIXEL_BAKE to fill it in the background)\n", TRACK_CACHE_DIR);
+#endif
+}
+
+// Остановить фоновый рендер (недописанный файл удаляется) и освободить кэш
+void track_cache_shutdown() {
+    if (track_cache.thread) {
+        SDL_LockMutex(track_cache.lock);
+        SDL_AtomicSet(&track_cache.quit, 1);
+        SDL_CondSignal(track_cache.wake);
+        SDL_UnlockMutex(track_cache.lock);
+        SDL_WaitThread(track_cache.thread, NULL);
+        SDL_DestroyCond(track_cache.wake);
+        SDL_DestroyMutex(track_cache.lock);
+    }
+
+    if (track_cache.hash_lock) { SDL_DestroyMutex(track_cache.hash_lock); }
+
+    free(track_cache.soundfont);
+    memset(&track_cache, 0, sizeof(track_cache));
+}
+
+/*
+    Предзагрузка следующего трека: пока играет текущий, поток загрузки открывает следующий (отображение кэша
+    или разбор .mid и SoundFont синтезатором), и переключение в цикле рендера сводится к замене указателя
+    и Mix_PlayMusic. Заказ — копия пути, а не индекс: список файлов может измениться, пока идёт загрузка.
+    Старый трек закрывается в том же потоке, Mix_FreeMusic тоже не блокирует кадр.
+    Кэшированный звук зависит от эффектов: если их переключили после заказа, предзагрузка не используется.
+    Кадр загрузку никогда не ждёт: если нужный трек ещё грузится (или его нет нигде), track_open заказывает его
+    и возвращает TRACK_PENDING, старый трек играет дальше, а цикл рендера раз в кадр повторяет track_open,
+    пока загрузка не закончится. Синхронно трек грузится только без потока загрузки.
+    Смены трека по-прежнему видны только при опросе Mix_PlayingMusic раз в кадр (вызывать Mix_* из
+    Mix_HookMusicFinished нельзя), а плавного перехода нет: Mix играет один музыкальный поток за раз.
+*/
+
+#define TRACK_RETIRE_SLOTS 4
+
+enum { PREFETCH_IDLE, PREFETCH_LOADING, PREFETCH_READY };
+
+#define TRACK_PENDING -1 // track_open: трек грузится в фоне, повторить в следующем кадре
+
+static struct {
+    SDL_Thread* thread;
+    SDL_mutex* lock;
+    SDL_cond* wake; // заказ, трек на закрытие или выход
+    char request[1024]; // "" — заказа нет
+    EffectParams request_params;
+    char path[1024]; // загружаемый или загруженный трек
+    Track track;
+    int state;
+    Track retired[TRACK_RETIRE_SLOTS];
+    int retired_count;
+    int quit; // всё под lock
+} track_prefetch;
+
+static int track_lru_find(const char* midi);
+
+static int track_prefetch_worker(void* data) {
+    (void)data;
+    SDL_LockMutex(track_prefetch.lock);
+
+    while (!track_prefetch.quit) {
+        if (track_prefetch.retired_count > 0) {
+            Track old = track_prefetch.retired[--track_prefetch.retired_count];
+            SDL_UnlockMutex(track_prefetch.lock);
+            track_close(&old);
+            SDL_LockMutex(track_prefetch.lock);
+        }
+
+        else if (track_prefetch.request[0]) {
+            EffectParams params = track_prefetch.request_params;
+            Track stale = track_prefetch.track, next = {0};
+            memset(&track_prefetch.track, 0, sizeof(Track)); // незабранный прошлый заказ
+            snprintf(track_prefetch.path, sizeof(track_prefetch.path), "%s", track_prefetch.request);
+            track_prefetch.request[0] = '\0';
+            track_prefetch.state = PREFETCH_LOADING;
+            SDL_UnlockMutex(track_prefetch.lock);
+
+            track_close(&stale);
+            int loaded = track_load(&next, track_prefetch.path, &params);
+
+            SDL_LockMutex(track_prefetch.lock);
+
+            // Пока грузили, заказали другой трек — этот уже не нужен
+            if (!loaded || track_prefetch.request[0] || track_prefetch.quit) {
+                SDL_UnlockMutex(track_prefetch.lock);
+                track_close(&next);
+                SDL_LockMutex(track_prefetch.lock);
+                track_prefetch.state = PREFETCH_IDLE;
+            }
 
-    if (hFind != INVALID_HANDLE_VALUE) {
-        char* sf2 = STRDUP(fd.cFileName);
-        FindClose(hFind);
-        return sf2;
+            else {
+                track_prefetch.track = next;
+                track_prefetch.state = PREFETCH_READY;
+            }
+        }
+
+        else { SDL_CondWait(track_prefetch.wake, track_prefetch.lock); }
     }
 
-#else
-    DIR* dir = opendir(".");
+    SDL_UnlockMutex(track_prefetch.lock);
+    return 0;
+}
 
-    if (dir) {
-        struct dirent* entry;
+// Запустить поток загрузки; без него треки открываются синхронно, как раньше
+void track_prefetch_init() {
+    track_prefetch.lock = SDL_CreateMutex();
+    track_prefetch.wake = SDL_CreateCond();
+    track_prefetch.thread = SDL_CreateThread(track_prefetch_worker, "track-prefetch", NULL);
 
-        while ((entry = readdir(dir))) {
-            char* name = entry->d_name;
-            size_t len = strlen(name);
+    if (!track_prefetch.thread) { printf("Warning: Track prefetch disabled (%s)\n", SDL_GetError()); }
+}
 
-            if (len >= 4 && strcasecmp(name + len - 4, ".sf2") == 0) {
-                char* sf2 = STRDUP(name);
-                closedir(dir);
-                return sf2;
-            }
+// Главный поток: заказать загрузку midi (незабранный прошлый трек закроет поток загрузки)
+void track_prefetch_request(const char* midi) {
+    if (!track_prefetch.thread || track_lru_find(midi) >= 0) { return; }
+
+    SDL_LockMutex(track_prefetch.lock);
+
+    // Нужный трек уже загружен или грузится — отменить только отложенный заказ
+    if (track_prefetch.state != PREFETCH_IDLE && strcmp(track_prefetch.path, midi) == 0) {
+        track_prefetch.request[0] = '\0';
+    }
+
+    else {
+        snprintf(track_prefetch.request, sizeof(track_prefetch.request), "%s", midi);
+        track_prefetch.request_params = effect_params;
+    }
+
+    SDL_CondSignal(track_prefetch.wake);
+    SDL_UnlockMutex(track_prefetch.lock);
+}
+
+// Главный поток: забрать предзагруженный midi. 1 — забран, 0 — его нет, TRACK_PENDING — заказан или грузится
+// (не ждать: начинать заново дольше, а кадр стоять не должен)
+static int track_prefetch_take(const char* midi, Track* track) {
+    if (!track_prefetch.thread) { return 0; }
+
+    SDL_LockMutex(track_prefetch.lock);
+
+    // Отложенный заказ другого трека отменяет текущую загрузку
+    int pending = strcmp(track_prefetch.request, midi) == 0 || (!track_prefetch.request[0] &&
+                  track_prefetch.state == PREFETCH_LOADING && strcmp(track_prefetch.path, midi) == 0);
+    int ready = !pending && track_prefetch.state == PREFETCH_READY && strcmp(track_prefetch.path, midi) == 0;
+    int taken = ready && (!track_prefetch.track.map || track_prefetch.track.params_hash == track_params_hash(&effect_params));
+
+    // Кэшированный звук собран под прежние эффекты — загрузить заново, устаревший закроет поток загрузки
+    if (ready && !taken) {
+        snprintf(track_prefetch.request, sizeof(track_prefetch.request), "%s", midi);
+        track_prefetch.request_params = effect_params;
+        SDL_CondSignal(track_prefetch.wake);
+        pending = 1;
+    }
+
+    if (taken) {
+        *track = track_prefetch.track;
+        memset(&track_prefetch.track, 0, sizeof(Track));
+        track_prefetch.state = PREFETCH_IDLE;
+    }
+
+    SDL_UnlockMutex(track_prefetch.lock);
+    return pending ? TRACK_PENDING : taken;
+}
+
+// Главный поток: закрыть трек в потоке загрузки; если очередь полна или потока нет — сразу
+static void track_retire(Track* track) {
+    int queued = 0;
+
+    if (!track->music) { return; }
+
+    if (track_prefetch.thread) {
+        SDL_LockMutex(track_prefetch.lock);
+
+        if (track_prefetch.retired_count < TRACK_RETIRE_SLOTS) {
+            track_prefetch.retired[track_prefetch.retired_count++] = *track;
+            SDL_CondSignal(track_prefetch.wake);
+            queued = 1;
         }
 
-        closedir(dir);
+        SDL_UnlockMutex(track_prefetch.lock);
     }
 
-#endif
-    return NULL;
+    if (!queued) { track_close(track); }
+
+    memset(track, 0, sizeof(Track));
 }
 
-int main(int argc, char* argv[]) {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
-        fprintf(stderr, "SDL init error: %s\n", SDL_GetError());
-        return 1;
+/*
+    Недавние треки: уже открытые треки после смены не закрываются, а остаются в LRU, и возврат к ним
+    (LEFT после RIGHT) — только Mix_PlayMusic. Объём ограничен бюджетом памяти (--track-memory, МБ):
+    кэшированный трек стоит размера WAV, трек синтезатора — .mid плюс весь SoundFont, потому что
+    fluidsynth в SDL_mixer загружает SoundFont в каждый Mix_Music (для других синтезаторов это оценка сверху).
+    Вытесняется давно игравший; закрытие — в потоке загрузки. LRU трогает только главный поток.
+*/
+
+#define TRACK_LRU_SLOTS 32
+#define TRACK_LRU_DEFAULT_MB 256
+
+static struct {
+    struct { Track track; size_t bytes; Uint64 used; } slots[TRACK_LRU_SLOTS];
+    int count;
+    size_t bytes, budget;
+    size_t soundfont_bytes;
+    Uint64 clock;
+} track_lru = { .budget = (size_t)TRACK_LRU_DEFAULT_MB << 20 };
+
+// Размер SoundFont для оценки памяти треков синтезатора; вызывается при старте
+void track_lru_init(const char* soundfont, int budget_mb) {
+    struct stat st;
+    track_lru.soundfont_bytes = stat(soundfont, &st) == 0 ? (size_t)st.st_size : 0;
+    track_lru.budget = (size_t)budget_mb << 20;
+}
+
+// Слот с midi, годным при текущих эффектах, или -1
+static int track_lru_find(const char* midi) {
+    for (int i = 0; i < track_lru.count; i++) {
+        const Track* track = &track_lru.slots[i].track;
+
+        if (strcmp(track->midi, midi) == 0 && (!track->map || track->params_hash == track_params_hash(&effect_params))) { return i; }
     }
 
-//
-    printf("WavePixel v0.1\n\n");
-    printf("Author: Ivan Svarkovsky  <https://github.com/Svarkovsky> License: MIT\n");
-    printf("A hybrid application merging real-time OpenGL graphics with MIDI audio playback.\n");
-//
+    return -1;
+}
+
+static Track track_lru_remove(int index) {
+    Track track = track_lru.slots[index].track;
+    track_lru.bytes -= track_lru.slots[index].bytes;
+    track_lru.slots[index] = track_lru.slots[--track_lru.count];
+    return track;
+}
+
+static int track_lru_take(const char* midi, Track* track) {
+    int index = track_lru_find(midi);
+
+    if (index < 0) { return 0; }
+
+    *track = track_lru_remove(index);
+    return 1;
+}
+
+// Положить закрываемый трек; вытеснить давние, пока не влезет (не влезает один — закрыть)
+static void track_lru_put(Track* track) {
+    struct stat st;
+
+    if (!track->music) { return; }
+
+    size_t bytes = track->map ? track->size : track_lru.soundfont_bytes + (stat(track->midi, &st) == 0 ? (size_t)st.st_size : 0);
+
+    // Тот же файл с другими эффектами больше не пригодится
+    for (int i = track_lru.count - 1; i >= 0; i--) {
+        if (strcmp(track_lru.slots[i].track.midi, track->midi) == 0) {
+            Track stale = track_lru_remove(i);
+            track_retire(&stale);
+        }
+    }
+
+    while (track_lru.count > 0 && (track_lru.count == TRACK_LRU_SLOTS || track_lru.bytes + bytes > track_lru.budget)) {
+        int oldest = 0;
+
+        for (int i = 1; i < track_lru.count; i++) {
+            if (track_lru.slots[i].used < track_lru.slots[oldest].used) { oldest = i; }
+        }
+
+        Track evicted = track_lru_remove(oldest);
+        track_retire(&evicted);
+    }
+
+    if (bytes > track_lru.budget) {
+        track_retire(track);
+        return;
+    }
+
+    track_lru.slots[track_lru.count].track = *track;
+    track_lru.slots[track_lru.count].bytes = bytes;
+    track_lru.slots[track_lru.count++].used = ++track_lru.clock;
+    track_lru.bytes += bytes;
+    memset(track, 0, sizeof(Track));
+}
+
+// Закрыть всё сразу (выход)
+void track_lru_clear() {
+    while (track_lru.count > 0) {
+        Track track = track_lru_remove(track_lru.count - 1);
+        track_close(&track);
+    }
+}
+
+// Главный поток: трек, который track_open ждёт из потока загрузки ("" — ничего не ждём)
+static char track_pending[1024];
+
+// Главный поток: сменить текущий трек на midi и запустить его. 1 — играет, 0 — не загрузился (текущий остаётся),
+// TRACK_PENDING — грузится в фоне, текущий играет дальше: вызывать снова, пока не вернёт 1 или 0.
+// Сменённый трек уходит в LRU
+int track_open(Track* track, const char* midi) {
+    Track next = {0};
+    int found = track_lru_take(midi, &next) ? 1 : track_prefetch_take(midi, &next);
+
+    // Нигде нет: заказать в фоне. Если его уже ждали, фоновая загрузка не удалась — второй раз не пробовать
+    if (found == 0 && track_prefetch.thread) {
+        if (strcmp(track_pending, midi) == 0) {
+            track_pending[0] = '\0';
+            return 0;
+        }
+
+        track_prefetch_request(midi);
+        found = TRACK_PENDING;
+    }
+
+    if (found == TRACK_PENDING) {
+        snprintf(track_pending, sizeof(track_pending), "%s", midi);
+        return TRACK_PENDING;
+    }
+
+    track_pending[0] = '\0';
+
+    if (!found && !track_load(&next, midi, &effect_params)) { return 0; }
 
-    int mixer_initialized = 0;
+    Track old = *track;
+    *track = next;
+    // Старый трек останавливается до смены режима, новый запускается после: колбэки между ними микшируют тишину,
+    // и ни один трек не проходит ни одного колбэка в чужом режиме (Mix_* ждут конца текущего колбэка)
+    Mix_HaltMusic();
+    effect_params.chain_bypass = track->map != NULL;
+    effect_params_publish();
+    Mix_PlayMusic(track->music, 1);
+    track_lru_put(&old);
+    return 1;
+}
+
+// Остановить поток загрузки и закрыть всё, что он держит; до track_cache_shutdown (загрузка заказывает рендер)
+void track_prefetch_shutdown() {
+    if (!track_prefetch.thread) { return; }
+
+    SDL_LockMutex(track_prefetch.lock);
+    track_prefetch.quit = 1;
+    SDL_CondSignal(track_prefetch.wake);
+    SDL_UnlockMutex(track_prefetch.lock);
+    SDL_WaitThread(track_prefetch.thread, NULL);
+
+    while (track_prefetch.retired_count > 0) { track_close(&track_prefetch.retired[--track_prefetch.retired_count]); }
+
+    track_close(&track_prefetch.track);
+    SDL_DestroyCond(track_prefetch.wake);
+    SDL_DestroyMutex(track_prefetch.lock);
+    memset(&track_prefetch, 0, sizeof(track_prefetch));
+}
+
+/*
+    Параллельный старт: микшер, SoundFont, кэш треков и первый обход каталога идут в отдельном потоке,
+    пока главный поток создаёт окно и контекст GL и компилирует шейдеры. Первый кадр рисуется, как только
+    готов рендер; звук подключается в цикле, когда поток закончит (до этого клавиши звука ничего не делают).
+    Шкала старта печатается один раз, когда готово и то, и другое.
+*/
+
+#define STARTUP_MARKS 32
+
+static struct {
+    Uint64 start;
+    struct { const char* thread; const char* label; Uint64 ticks; } marks[STARTUP_MARKS];
+    SDL_atomic_t count;
+} startup_timeline;
+
+// Отметка на шкале старта; label — строковый литерал
+void startup_mark(const char* thread, const char* label) {
+    int i = SDL_AtomicAdd(&startup_timeline.count, 1);
+
+    if (i < STARTUP_MARKS) {
+        startup_timeline.marks[i].thread = thread;
+        startup_timeline.marks[i].label = label;
+        startup_timeline.marks[i].ticks = SDL_GetPerformanceCounter();
+    }
+}
 
-    if (Mix_Init(MIX_INIT_MID) >= 0 && Mix_OpenAudio(44100, AUDIO_S16SYS, 2, 1024) >= 0) {
-        mixer_initialized = 1;
-        Mix_SetPostMix(audio_effect, NULL);
+// Печать по времени; вызывать, когда все потоки старта закончились
+void startup_timeline_report() {
+    int count = SDL_AtomicGet(&startup_timeline.count);
+    count = count < STARTUP_MARKS ? count : STARTUP_MARKS;
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    printf("Startup timeline (ms since start):\n");
+
+    // Отметок немного: выбором по возрастанию времени
+    for (int printed = 0, last = -1; printed < count; printed++) {
+        int next = -1;
+
+        for (int i = 0; i < count; i++) {
+            int later = last < 0 || startup_timeline.marks[i].ticks > startup_timeline.marks[last].ticks ||
+                        (startup_timeline.marks[i].ticks == startup_timeline.marks[last].ticks && i > last);
+
+            if (later && (next < 0 || startup_timeline.marks[i].ticks < startup_timeline.marks[next].ticks)) { next = i; }
+        }
+
+        last = next;
+        printf("  %8.1f  %-6s %s\n", (startup_timeline.marks[next].ticks - startup_timeline.start) * 1000.0 / frequency,
+               startup_timeline.marks[next].thread, startup_timeline.marks[next].label);
+    }
+}
+
+typedef struct {
+    int sample_rate;       // вход
+    int buffer_frames;
+    int use_cache;
+    int track_memory_mb;
+    MidiList* midi_list;   // заполняется потоком
+    int mixer_initialized; // выход
+    EffectChain* chain;
+    SDL_atomic_t done;
+} AudioStartup;
+
+static int audio_startup(void* data) {
+    AudioStartup* startup = data;
+
+    if (Mix_Init(MIX_INIT_MID) >= 0 && Mix_OpenAudio(startup->sample_rate, AUDIO_S16SYS, 2, startup->buffer_frames) >= 0) {
+        // Устройство может дать другую частоту (и число каналов): задержки считаются от полученной
+        int obtained_rate = 0, obtained_channels = 0;
+        Uint16 obtained_format = 0;
+        Mix_QuerySpec(&obtained_rate, &obtained_format, &obtained_channels);
+        startup->mixer_initialized = 1;
+        startup_mark("audio", "mixer open");
+        // Размер буфера Mix_QuerySpec не возвращает: полученный печатается после первого колбэка
+        printf("Audio: %d Hz, %d channels, buffer %d frames requested\n", obtained_rate, obtained_channels, startup->buffer_frames);
+
+        if (obtained_format == AUDIO_S16SYS && obtained_channels == 2 && (startup->chain = effect_chain_create(obtained_rate))) {
+            audio_format.sample_rate = obtained_rate;
+            dsp_init(1);
+            effect_chain_reset(startup->chain, effect_params_acquire());
+            callback_timing_reset();
+            audio_meter_reset();
+            Mix_SetPostMix(audio_effect, startup->chain);
+            startup_mark("audio", "effect chain ready");
+        }
+
+        else {
+            printf("Warning: Effects need S16 stereo up to %d Hz, audio effects disabled\n", MAX_SAMPLE_RATE);
+        }
     }
 
     else {
@@ -896,20 +4489,174 @@ int main(int argc, char* argv[]) {
 
     char* soundfont = find_soundfont();
 
-    if (mixer_initialized && soundfont) {
+    if (startup->mixer_initialized && soundfont) {
         Mix_SetSoundFonts(soundfont);
         printf("Using SoundFont: %s\n", soundfont);
+
+        // Без цепочки эффектов кэш не нужен: в нём звук уже с эффектами
+        if (startup->use_cache && startup->chain) { track_cache_init(soundfont); }
+
+        track_prefetch_init();
+        track_lru_init(soundfont, startup->track_memory_mb);
+        startup_mark("audio", "SoundFont and track cache ready");
     }
 
-    else if (mixer_initialized) {
+    else if (startup->mixer_initialized) {
         printf("Warning: No SoundFont (.sf2) found, audio disabled\n");
         Mix_CloseAudio();
         Mix_Quit();
-        mixer_initialized = 0;
+        effect_chain_destroy(startup->chain);
+        startup->chain = NULL;
+        startup->mixer_initialized = 0;
     }
 
     if (soundfont) { free(soundfont); }
 
+    if (startup->mixer_initialized) {
+        midi_watch_init();
+        update_midi_list(startup->midi_list);
+        startup_mark("audio", "MIDI scan");
+
+        if (startup->midi_list->count == 0) {
+            printf("No MIDI files found\n");
+        }
+
+        else {
+            printf("Found %d MIDI files\n", startup->midi_list->count);
+        }
+    }
+
+    startup_mark("audio", "audio ready");
+    SDL_AtomicSet(&startup->done, 1);
+    return 0;
+}
+
+// Дождаться потока старта и закрыть звук; для выхода по ошибке до главного цикла
+static void audio_startup_abort(SDL_Thread* thread, AudioStartup* startup) {
+    SDL_WaitThread(thread, NULL);
+    track_prefetch_shutdown();
+    track_cache_shutdown();
+
+    if (startup->mixer_initialized) { Mix_CloseAudio(); Mix_Quit(); }
+
+    effect_chain_destroy(startup->chain);
+}
+
+// Главный поток: подключить звук, когда старт закончился — в потоке или синхронно, если поток не создался.
+// Первый трек (клавиша RIGHT, current_track ещё 0) грузится с SoundFont в фоне, пока пользователь смотрит на сцену
+static void audio_startup_adopt(const AudioStartup* startup, int* mixer_initialized, EffectChain** chain) {
+    *mixer_initialized = startup->mixer_initialized;
+    *chain = startup->chain;
+
+    if (startup->mixer_initialized && startup->midi_list->count > 0) {
+        track_prefetch_request(startup->midi_list->files[1 % startup->midi_list->count]);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* bench_input = NULL;
+    const char* bake_dir = NULL;
+    int bake_raw = 0;
+    int use_cache = 1;
+    int track_memory_mb = TRACK_LRU_DEFAULT_MB;
+    const char* bench_output = NULL;
+    int sample_rate = SAMPLE_RATE;
+    int buffer_frames = AUDIO_BUFFER_FRAMES;
+    int threads = 0;
+    int pace_mode = PACE_ADAPTIVE_VSYNC;
+    float target_fps = 0.0f;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_input = argv[++i];
+
+            if (i + 1 < argc && argv[i + 1][0] != '-') { bench_output = argv[++i]; }
+        }
+
+        else if (strcmp(argv[i], "--effect-order") == 0 && i + 1 < argc) {
+            if (!effect_order_parse(argv[++i], effect_params.order)) { return 1; }
+        }
+
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) { sample_rate = atoi(argv[++i]); }
+
+        else if (strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+            buffer_frames = atoi(argv[++i]);
+
+            if (buffer_frames < AUDIO_MIN_BUFFER_FRAMES || buffer_frames > AUDIO_MAX_BUFFER_FRAMES || (buffer_frames & (buffer_frames - 1))) {
+                fprintf(stderr, "Buffer must be a power of two in %d..%d frames\n", AUDIO_MIN_BUFFER_FRAMES, AUDIO_MAX_BUFFER_FRAMES);
+                return 1;
+            }
+        }
+
+        else if (strcmp(argv[i], "--low-latency") == 0) { buffer_frames = AUDIO_LOW_LATENCY_FRAMES; }
+
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) { threads = atoi(argv[++i]); }
+
+        else if (strcmp(argv[i], "--bake") == 0 && i + 1 < argc) { bake_dir = argv[++i]; }
+
+        else if (strcmp(argv[i], "--raw") == 0) { bake_raw = 1; }
+
+        else if (strcmp(argv[i], "--no-cache") == 0) { use_cache = 0; }
+
+        else if (strcmp(argv[i], "--track-memory") == 0 && i + 1 < argc) { track_memory_mb = atoi(argv[++i]); }
+
+        else if (strcmp(argv[i], "--vsync") == 0) { pace_mode = PACE_VSYNC; }
+
+        else if (strcmp(argv[i], "--adaptive-vsync") == 0) { pace_mode = PACE_ADAPTIVE_VSYNC; }
+
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            pace_mode = PACE_SLEEP;
+            target_fps = (float)atof(argv[++i]);
+        }
+
+        else if (strcmp(argv[i], "--scan") == 0 && i + 1 < argc) { return run_scan(argv[i + 1]); }
+
+        else if (strcmp(argv[i], "--batch") == 0 && i + 2 < argc) { return run_batch(argv[i + 1], argv + i + 2, argc - i - 2, threads, sample_rate); }
+
+        else {
+            fprintf(stderr, "Usage: %s [--rate HZ] [--buffer FRAMES | --low-latency] [--effect-order stage,...] [--threads N] [--no-cache] [--track-memory MB]\n"
+                    "          [--vsync | --adaptive-vsync | --fps N]\n"
+                    "          [--bench input.wav [output.wav] | --batch OUT_DIR input.wav... | --bake OUT_DIR [--raw] | --scan DIR]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench_input) { return run_bench(bench_input, bench_output, buffer_frames, sample_rate); }
+
+    if (bake_dir) { return run_bake(bake_dir, bake_raw, sample_rate, threads); }
+
+    startup_timeline.start = SDL_GetPerformanceCounter();
+
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
+        fprintf(stderr, "SDL init error: %s\n", SDL_GetError());
+        return 1;
+    }
+
+//
+    printf("WavePixel v0.1\n\n");
+    printf("Author: Ivan Svarkovsky  <https://github.com/Svarkovsky> License: MIT\n");
+    printf("A hybrid application merging real-time OpenGL graphics with MIDI audio playback.\n");
+//
+
+    startup_mark("main", "SDL init");
+    // До запуска потока: клавиши эффектов публикуют параметры с первого кадра
+    effect_params_init();
+    AudioStartup audio_startup_data = {
+        .sample_rate = sample_rate, .buffer_frames = buffer_frames, .use_cache = use_cache,
+        .track_memory_mb = track_memory_mb, .midi_list = midi_list_init()
+    };
+    SDL_Thread* audio_thread = SDL_CreateThread(audio_startup, "audio-startup", &audio_startup_data);
+    MidiList* midi_list = audio_startup_data.midi_list;
+    int mixer_initialized = 0; // звук подключается в цикле, когда поток старта закончит
+    EffectChain* audio_chain = NULL;
+
+    // Поток не создался: старт здесь же, до окна, и звук подключается сразу
+    if (!audio_thread) {
+        audio_startup(&audio_startup_data);
+        audio_startup_adopt(&audio_startup_data, &mixer_initialized, &audio_chain);
+    }
+    int first_frame = 1, startup_reported = 0, variants_pending = 1, buffer_reported = 0;
+
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 2);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
     SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
@@ -920,92 +4667,92 @@ int main(int argc, char* argv[]) {
 
     if (!window) {
         fprintf(stderr, "Window creation error: %s\n", SDL_GetError());
-
-        if (mixer_initialized) { Mix_CloseAudio(); Mix_Quit(); }
-
+        audio_startup_abort(audio_thread, &audio_startup_data);
         SDL_Quit();
         return 1;
     }
 
+    startup_mark("main", "window");
     SDL_GLContext gl_context = SDL_GL_CreateContext(window);
 
     if (!gl_context) {
         fprintf(stderr, "GL context error: %s\n", SDL_GetError());
         SDL_DestroyWindow(window);
-
-        if (mixer_initialized) { Mix_CloseAudio(); Mix_Quit(); }
-
+        audio_startup_abort(audio_thread, &audio_startup_data);
         SDL_Quit();
         return 1;
     }
 
+    startup_mark("main", "GL context");
     glewExperimental = GL_TRUE;
 
     if (glewInit() != GLEW_OK) {
         fprintf(stderr, "GLEW init error\n");
         SDL_GL_DeleteContext(gl_context);
         SDL_DestroyWindow(window);
-
-        if (mixer_initialized) { Mix_CloseAudio(); Mix_Quit(); }
-
+        audio_startup_abort(audio_thread, &audio_startup_data);
         SDL_Quit();
         return 1;
     }
 
-    GLData gl_data = {0};
+    startup_mark("main", "GLEW");
+    program_cache_init(use_cache);
+    GLData gl_data = { .features = sun_enabled ? SHADER_SUN : 0 };
 
     if (!init_gl(&gl_data)) {
         fprintf(stderr, "OpenGL init failed\n");
         SDL_GL_DeleteContext(gl_context);
         SDL_DestroyWindow(window);
-
-        if (mixer_initialized) { Mix_CloseAudio(); Mix_Quit(); }
-
+        audio_startup_abort(audio_thread, &audio_startup_data);
         SDL_Quit();
         return 1;
     }
 
+    startup_mark("main", "shaders");
     ColorState color_state = {
         .seed = 42, .palette_size = 24, .current_palette = 0, .next_palette = 1,
         .blend_factor = 0.0f, .blend_speed = 0.0f, .blend_enabled = 0, .history = {0, 0, 0}
     };
 
-    MidiList* midi_list = midi_list_init();
-
-    if (mixer_initialized) {
-        update_midi_list(midi_list);
-
-        if (midi_list->count == 0) {
-            printf("No MIDI files found\n");
-        }
-
-        else {
-            printf("Found %d MIDI files\n", midi_list->count);
-        }
-    }
-
-    Mix_Music* music = NULL;
+    Track track = {0};
+    AudioReactive audio_reactive = { 1.0f, 0.0f, 0.0f };
     int current_track = 0;
     int running = 1, fullscreen = 0, parallax_enabled = 0, clouds_enabled = 0;
-    float time = 0.0f, avg_frame_time = 16.0f;
+    float time = 0.0f;
+    FramePacer pacer;
+    frame_pacer_init(&pacer, pace_mode, target_fps, window);
 
     while (running) {
-        Uint32 frame_start = SDL_GetTicks();
+        float delta_time = frame_pacer_begin(&pacer);
         SDL_Event e;
         const Uint8* keystate = SDL_GetKeyboardState(NULL);
 
-// Автодобавление .midi (задержка 5 секунд)
+        // Поток старта закончил — подключить звук
+        if (audio_thread && SDL_AtomicGet(&audio_startup_data.done)) {
+            SDL_WaitThread(audio_thread, NULL);
+            audio_thread = NULL;
+            audio_startup_adopt(&audio_startup_data, &mixer_initialized, &audio_chain);
+        }
+
+        if (!startup_reported && !audio_thread && !first_frame && !variants_pending) {
+            startup_timeline_report();
+            startup_reported = 1;
+        }
+
+        if (!buffer_reported && mixer_initialized && SDL_AtomicGet(&callback_timing.buffer_frames) > 0) {
+            audio_format.buffer_frames = SDL_AtomicGet(&callback_timing.buffer_frames);
+            printf("Audio buffer: %d frames (%.1f ms)\n", audio_format.buffer_frames, audio_format.buffer_frames * 1000.0 / audio_format.sample_rate);
+            buffer_reported = 1;
+        }
+
+// Автодобавление .midi (inotify сразу, иначе обход раз в 5 секунд)
         static Uint32 last_update = 0;
         Uint32 current_time = SDL_GetTicks();
 
-        if (mixer_initialized && current_time - last_update >= 5000) {
-            int old_count = midi_list->count;
-            update_midi_list(midi_list);
-
-            if (midi_list->count > old_count && current_track >= old_count) {
-                current_track = old_count; // Перейти к первому новому треку
-            }
+        if (mixer_initialized && midi_watch.fd >= 0) { midi_watch_poll(midi_list, &current_track); }
 
+        else if (mixer_initialized && current_time - last_update >= 5000) {
+            midi_list_rescan(midi_list, &current_track);
             last_update = current_time;
         }
 
@@ -1060,16 +4807,54 @@ int main(int argc, char* argv[]) {
                         printf("Blends %s\n", color_state.blend_enabled ? "enabled" : "disabled");
                         break;
 
+                    case SDL_SCANCODE_1:
+                    case SDL_SCANCODE_2:
+                    case SDL_SCANCODE_3:
+                    case SDL_SCANCODE_4:
+                    case SDL_SCANCODE_5:
+                    case SDL_SCANCODE_6:
+                    case SDL_SCANCODE_7: {
+                        int index = e.key.keysym.scancode - SDL_SCANCODE_1;
+                        *effect_switches[index].enabled = !*effect_switches[index].enabled;
+                        effect_params_publish();
+                        // У трека из кэша эффекты уже в звуке, вживую переключается только лимитер
+                        int deferred = track.map && effect_switches[index].enabled != &effect_params.limiter_enabled;
+                        printf("%s %s%s\n", effect_switches[index].name, *effect_switches[index].enabled ? "enabled" : "disabled",
+                               deferred ? " from the next track (this one plays from the cache)" : "");
+                        break;
+                    }
+
+                    case SDL_SCANCODE_MINUS:
+                    case SDL_SCANCODE_EQUALS:
+                        effect_params.global_volume += e.key.keysym.scancode == SDL_SCANCODE_MINUS ? -0.05f : 0.05f;
+                        effect_params.global_volume = fminf(fmaxf(effect_params.global_volume, 0.0f), 1.0f);
+                        effect_params_publish();
+                        printf("Volume %.0f%%\n", effect_params.global_volume * 100.0f);
+                        break;
+
+                    case SDL_SCANCODE_R:
+                        resolution_scaler_cycle(&gl_data.scaler);
+                        break;
+
+                    case SDL_SCANCODE_T:
+                        resolution_scaler_report(&gl_data.scaler);
+                        frame_pacer_report(&pacer);
+
+                        if (mixer_initialized) { callback_timing_report(); }
+
+                        break;
+
                     case SDL_SCANCODE_RIGHT:
                         if (mixer_initialized && midi_list->count > 0) {
-                            if (music) { Mix_HaltMusic(); }
-
                             current_track = (current_track + 1) % midi_list->count;
-                            music = Mix_LoadMUS(midi_list->files[current_track]);
 
-                            if (music) {
-                                Mix_PlayMusic(music, 1);
-                                printf("Playing: %s\n", midi_list->files[current_track]);
+                            int opened = track_open(&track, midi_list->files[current_track]);
+
+                            if (opened == TRACK_PENDING) { printf("Loading: %s\n", midi_list->files[current_track]); }
+
+                            else if (opened) {
+                                printf("Playing: %s%s\n", midi_list->files[current_track], track.map ? " (cached)" : "");
+                                track_prefetch_request(midi_list->files[(current_track + 1) % midi_list->count]);
                             }
 
                             else {
@@ -1081,14 +4866,15 @@ int main(int argc, char* argv[]) {
 
                     case SDL_SCANCODE_LEFT:
                         if (mixer_initialized && midi_list->count > 0) {
-                            if (music) { Mix_HaltMusic(); }
-
                             current_track = (current_track - 1 + midi_list->count) % midi_list->count;
-                            music = Mix_LoadMUS(midi_list->files[current_track]);
 
-                            if (music) {
-                                Mix_PlayMusic(music, 1);
-                                printf("Playing: %s\n", midi_list->files[current_track]);
+                            int opened = track_open(&track, midi_list->files[current_track]);
+
+                            if (opened == TRACK_PENDING) { printf("Loading: %s\n", midi_list->files[current_track]); }
+
+                            else if (opened) {
+                                printf("Playing: %s%s\n", midi_list->files[current_track], track.map ? " (cached)" : "");
+                                track_prefetch_request(midi_list->files[(current_track + 1) % midi_list->count]);
                             }
 
                             else {
@@ -1124,44 +4910,108 @@ int main(int argc, char* argv[]) {
             SDL_Delay(2000); // Задержка 2 секунды
         }
 
-        if (mixer_initialized && midi_list->count > 0 && !Mix_PlayingMusic() && music) {
-            Mix_FreeMusic(music);
-            music = Mix_LoadMUS(midi_list->files[current_track]);
+        // Заказанный трек догрузился в фоне: переключиться сейчас, кадр загрузку не ждал
+        if (mixer_initialized && track_pending[0]) {
+            char midi[1024];
+            snprintf(midi, sizeof(midi), "%s", track_pending);
+            int opened = track_open(&track, midi);
+
+            if (opened > 0) {
+                printf("Playing: %s%s\n", midi, track.map ? " (cached)" : "");
+
+                // Следующий за тем, что заиграл: после клавиши current_track на нём, после автоперехода — уже дальше
+                int index = midi_list_find(midi_list, midi);
+
+                if (midi_list->count > 0) { track_prefetch_request(midi_list->files[index >= 0 ? (index + 1) % midi_list->count : current_track]); }
+            }
+
+            else if (opened == 0) {
+                printf("Failed to load: %s\n", midi);
+            }
+        }
+
+        else if (mixer_initialized && midi_list->count > 0 && !Mix_PlayingMusic() && track.music) {
+            int opened = track_open(&track, midi_list->files[current_track]);
 
-            if (music) {
-                Mix_PlayMusic(music, 1);
-                printf("Playing: %s\n", midi_list->files[current_track]);
+            if (opened > 0) {
+                printf("Playing: %s%s\n", midi_list->files[current_track], track.map ? " (cached)" : "");
             }
 
             current_track = (current_track + 1) % midi_list->count;
+
+            // Ждущий трек следующий заказ бы отменил; его сделает переключение выше
+            if (opened != TRACK_PENDING) { track_prefetch_request(midi_list->files[current_track]); }
         }
 
         int width, height;
         SDL_GetWindowSize(window, &width, &height);
-        glViewport(0, 0, width, height);
-        time += 0.016f;
+        time += delta_time;
 
-        Color final_color = manage_color_state(&color_state, 0.016f);
-        glUseProgram(gl_data.shader_program);
-        glUniform3f(glGetUniformLocation(gl_data.shader_program, "base_color"), final_color.r, final_color.g, final_color.b);
+        Color final_color = manage_color_state(&color_state, delta_time);
+        SceneUniforms scene = {
+            .time = time, .battery = audio_reactive_update(&audio_reactive, delta_time),
+            .resolution = { (float)width, (float)height }, .base_color = { final_color.r, final_color.g, final_color.b }
+        };
+        gl_data.features = (sun_enabled ? SHADER_SUN : 0) | (parallax_enabled ? SHADER_PARALLAX : 0) | (clouds_enabled ? SHADER_CLOUDS : 0);
 
-        Uint32 render_time;
-        render_scene(&gl_data, width, height, time, &render_time, parallax_enabled, clouds_enabled);
+        render_scene(&gl_data, &scene, width, height);
         SDL_GL_SwapWindow(window);
-        stabilize_frame_rate(frame_start, render_time, &avg_frame_time, fullscreen);
+
+        if (first_frame) {
+            startup_mark("main", "first frame");
+            first_frame = 0;
+        }
+
+        else if (variants_pending) {
+            variants_pending = shader_variants_prewarm(&gl_data);
+
+            if (!variants_pending) {
+                startup_mark("main", "shader variants");
+
+                if (program_cache.enabled) {
+                    printf("Program cache: %d programs loaded, %d compiled%s\n", program_cache.loaded, program_cache.compiled,
+                           program_cache.rejected ? " (stale entries replaced)" : "");
+                }
+            }
+        }
+
+        resolution_scaler_update(&gl_data.scaler, gl_data.frames.gpu_time, pacer.period, gl_data.render.has_timer);
+        frame_pacer_wait(&pacer, gl_data.frames.gpu_time);
+    }
+
+    // Выход раньше, чем закончился старт звука
+    if (audio_thread) {
+        SDL_WaitThread(audio_thread, NULL);
+        mixer_initialized = audio_startup_data.mixer_initialized;
+        audio_chain = audio_startup_data.chain;
     }
 
-    if (music) { Mix_FreeMusic(music); }
+    track_close(&track);
+    track_lru_clear();
+    track_prefetch_shutdown();
+    track_cache_shutdown();
+
+    frame_pacer_report(&pacer);
 
+    if (mixer_initialized) { callback_timing_report(); }
+
+    midi_watch_close();
     midi_list_free(midi_list);
     glDeleteVertexArrays(1, &gl_data.vao);
     glDeleteBuffers(1, &gl_data.vbo);
-    glDeleteProgram(gl_data.shader_program);
+    shader_variants_destroy(&gl_data);
+
+    if (gl_data.render.ubo) { glDeleteBuffers(1, &gl_data.render.ubo); }
+
+    frame_pipeline_destroy(&gl_data.frames, &gl_data.render);
+    resolution_scaler_destroy(&gl_data.scaler);
+
     SDL_GL_DeleteContext(gl_context);
     SDL_DestroyWindow(window);
 
     if (mixer_initialized) { Mix_CloseAudio(); Mix_Quit(); }
 
+    effect_chain_destroy(audio_chain);
     SDL_Quit();
     return 0;
 }